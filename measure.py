@@ -1,14 +1,42 @@
-import os
+import json
+import subprocess
 import sys
+import tempfile
 
 count = int(sys.argv[1])
-data = [0, 0, 0, 0]
 
-for i in range(count):
-    stream = os.popen("./messaging -n 1 -k 5 -m 1000 -t 1000 -r 1 -ll:cpu 2")
-    res = stream.read().strip().splitlines()
-    for j in range(len(data)):
-        data[j] += float(res[j + 1].split()[2])
-for j in range(len(data)):
-    data[j] /= count
-print(data)
+# A single process runs all iterations and summarizes them.
+with tempfile.NamedTemporaryFile(suffix=".json") as results:
+    subprocess.run(
+        [
+            "./messaging",
+            "-n",
+            "1",
+            "-k",
+            "5",
+            "-m",
+            "1000",
+            "-t",
+            "1000",
+            "-r",
+            "1",
+            "-i",
+            str(count),
+            "-y",
+            results.name,
+            "-ll:cpu",
+            "2",
+        ],
+        check=True,
+        stdout=subprocess.DEVNULL,
+    )
+    workload = json.load(results)["workloads"][0]
+latency = workload["latency_ns"]
+print(
+    [
+        workload["time_ns"]["mean"],
+        workload["goodput"]["mean"],
+        latency["Fetch"]["p50"],
+        latency["Post"]["p50"],
+    ]
+)
@@ -1,34 +1,78 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <fstream>
 #include <ctime>
 #include <deque>
 #include <functional>
 #include <iomanip>
 #include <iostream>
-#include <list>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "getopt.h"
 #include "legion.h"
+#include "mappers/default_mapper.h"
+
+// Whether to register the tasks that launch no subtasks as leaf variants.
+#ifndef LEAF_TASKS
+#define LEAF_TASKS 1
+#endif
 
 enum TaskID {
     INIT_TASK,
     DISPATCH_TASK,
     PREPARE_FETCH_TASK,
     EXECUTE_FETCH_TASK,
+    EXECUTE_FETCH_BATCH_TASK,
     PREPARE_POST_TASK,
     EXECUTE_POST_TASK,
+    APPEND_POST_TASK,
+    LOW_WATER_TASK,
+    FUSED_FETCH_TASK,
+    FUSED_FETCH_BATCH_TASK,
+    COUNT_FOLLOWS_TASK,
+    BUILD_FOLLOWS_TASK,
+    INBOX_FETCH_TASK,
+    DELIVER_TASK,
+    DISPATCHER_TASK,
+};
+
+enum ReductionID {
+    MAX_MESSAGE_ID_REDOP = 1,
 };
 
-enum UserFieldID { FOLLOWED_CHANNEL_IDS };
+enum ShardingFunctorID {
+    OWNER_SHARDING = 1,
+};
+
+// Range of the user's entries in the follows region.
+enum UserFieldID { FOLLOWED_RANGE };
+
+enum FollowFieldID { FOLLOWED_CHANNEL_ID };
 
 enum ChannelFieldID {
     NEXT_MSG_ID,
+    LOW_WATER_MSG_ID,
 };
 
-enum UserFirstUnreadFieldID { NEXT_UNREAD_MSG_IDS };
+enum FollowNextUnreadFieldID { NEXT_UNREAD_MSG_ID };
 
 enum MessageFieldID {
     AUTHOR_ID,
@@ -36,13 +80,31 @@ enum MessageFieldID {
     TEXT,
 };
 
-constexpr unsigned int CHANNELS_PER_USER = 4;
+enum TextFieldID { TEXT_BYTE };
+
+// Entries ever delivered to the user's inbox, and ever read or skipped.
+enum InboxHeadFieldID {
+    INBOX_END,
+    INBOX_NEXT_UNREAD,
+};
+
+enum InboxFieldID { INBOX_ENTRY };
+
+// Default number of channels that each user follows.
+constexpr unsigned int DEFAULT_FOLLOWS = 4;
 constexpr unsigned int MESSAGE_LENGTH = 256;
+// Default number of messages that a fetch returns across all its channels.
 constexpr unsigned int MAX_RETURNED_MESSAGES = 20;
+// Longest text stored in the TEXT field itself.
+constexpr unsigned int INLINE_TEXT_LENGTH = 10;
+// Text arena bytes for each message slot of a channel.
+constexpr unsigned int TEXT_BYTES_PER_MESSAGE = 64;
 constexpr char msg_template[] = "This is a message from user %d on channel %d";
 
 typedef uint16_t user_id_t;
 typedef uint8_t channel_id_t;
+// Index of an entry of the follow graph.
+typedef uint32_t follow_id_t;
 typedef uint32_t message_id_t;
 
 class MessageText {
@@ -57,25 +119,33 @@ public:
     operator void *() { return buffer; }
     operator char *() { return buffer; }
     char &operator[](size_t n) { return buffer[n]; }
-    MessageText &operator=(MessageText text) {
-        memcpy(buffer, text, sizeof buffer);
-        return *this;
-    }
+    const char *c_str() const { return buffer; }
+    size_t length() const { return strnlen(buffer, MESSAGE_LENGTH - 1); }
 };
 
-template <typename T>
-class PerUserChannel {
-private:
-    T array[CHANNELS_PER_USER];
+/* Text of a stored message, kept in the TEXT field with the message's ID, so
+ * that readers can tell when a later message has taken the slot.
+ *
+ * Short texts are inlined. Longer ones live in the channel's text arena at
+ * offset(), also after the ID of the message they belong to, so that readers
+ * can tell when a later text has overwritten them. */
+struct TextRef {
+    message_id_t message_id;
+    uint16_t length;
+    char bytes[INLINE_TEXT_LENGTH];
 
-public:
-    PerUserChannel() {
-        for (size_t i = 0; i < CHANNELS_PER_USER; i++) array[i] = T();
+    bool is_inline() const { return length <= INLINE_TEXT_LENGTH; }
+    uint32_t offset() const {
+        uint32_t offset;
+        memcpy(&offset, bytes, sizeof offset);
+        return offset;
     }
-    PerUserChannel(T src[]) { memcpy(array, src, sizeof array); }
+    void set_offset(uint32_t offset) { memcpy(bytes, &offset, sizeof offset); }
 
-    operator void *() { return array; }
-    T &operator[](size_t n) { return array[n]; }
+    // Arena bytes taken by a text of the given length.
+    static size_t entry_size(size_t length) {
+        return sizeof(message_id_t) + length;
+    }
 };
 
 struct Message {
@@ -85,38 +155,365 @@ struct Message {
     MessageText text;
 };
 
-class MessageList {
-private:
-    Message msgs[MAX_RETURNED_MESSAGES];
+/* Reference to a message in the inbox of a follower of its channel. Every
+ * post takes a new timestamp, so a slot whose timestamp differs has been
+ * posted to again since. */
+struct InboxEntry {
+    channel_id_t channel_id;
+    message_id_t message_id;
+    time_t timestamp;
+};
 
-public:
-    Message &operator[](size_t n) { return msgs[n]; }
+// Helpers for the serialized task results below.
+template <typename T>
+void serialize_value(char *&buffer, const T &value) {
+    memcpy(buffer, &value, sizeof value);
+    buffer += sizeof value;
+}
+
+template <typename T>
+void deserialize_value(const char *&buffer, T &value) {
+    memcpy(&value, buffer, sizeof value);
+    buffer += sizeof value;
+}
+
+// Vectors are serialized as their length followed by their elements.
+template <typename T>
+size_t serialized_size(const std::vector<T> &values) {
+    return sizeof(uint32_t) + values.size() * sizeof(T);
+}
+
+template <typename T>
+void serialize_value(char *&buffer, const std::vector<T> &values) {
+    serialize_value(buffer, (uint32_t)values.size());
+    memcpy(buffer, values.data(), values.size() * sizeof(T));
+    buffer += values.size() * sizeof(T);
+}
+
+template <typename T>
+void deserialize_value(const char *&buffer, std::vector<T> &values) {
+    uint32_t size;
+    deserialize_value(buffer, size);
+    values.resize(size);
+    memcpy(values.data(), buffer, size * sizeof(T));
+    buffer += size * sizeof(T);
+}
+
+// Maps are serialized as their size followed by their keys and values.
+template <typename K, typename V>
+size_t serialized_size(const std::unordered_map<K, V> &values) {
+    return sizeof(uint32_t) + values.size() * (sizeof(K) + sizeof(V));
+}
+
+template <typename K, typename V>
+void serialize_value(char *&buffer, const std::unordered_map<K, V> &values) {
+    serialize_value(buffer, (uint32_t)values.size());
+    for (auto &[key, value] : values) {
+        serialize_value(buffer, key);
+        serialize_value(buffer, value);
+    }
+}
+
+template <typename K, typename V>
+void deserialize_value(const char *&buffer, std::unordered_map<K, V> &values) {
+    uint32_t size;
+    deserialize_value(buffer, size);
+    values.clear();
+    for (uint32_t i = 0; i < size; i++) {
+        K key;
+        deserialize_value(buffer, key);
+        deserialize_value(buffer, values[key]);
+    }
+}
+
+typedef uint64_t pending_id_t;
+
+/* Placement of each channel's messages in its row of the messages region.
+ *
+ * A channel keeps its messages in a ring of capacity slots, split into blocks
+ * of block_size slots, and message IDs keep growing as slots are reused. With
+ * a nonzero retention, readers skip messages older than the newest retention
+ * ones. With zero retention, messages are kept until every follower has read
+ * them, tracked by the channel's LOW_WATER_MSG_ID, and posts to a full channel
+ * fail.
+ *
+ * Texts that are not inlined go to the channel's row of the texts region, an
+ * arena of text_capacity bytes that is written in order and wraps around. */
+struct MessageRing {
+    message_id_t capacity;
+    message_id_t block_size;
+    message_id_t retention;
+    uint32_t text_capacity;
+
+    message_id_t slot(message_id_t id) const { return id % capacity; }
+    message_id_t block(message_id_t id) const { return slot(id) / block_size; }
+
+    // First message that a reader at next_unread can still get.
+    message_id_t first_retained(message_id_t next_unread,
+                                message_id_t next_msg) const {
+        if (retention != 0 && next_msg - next_unread > retention) {
+            return next_msg - retention;
+        }
+        return next_unread;
+    }
+
+    // Whether storing the message must not overwrite an unread one.
+    bool can_store(message_id_t id, message_id_t low_water) const {
+        return retention != 0 || id < low_water + capacity;
+    }
+
+    // Arena offset of a text entry written at cursor, which it advances past
+    // the entry. Entries that would cross the end of the arena start over.
+    uint32_t place_text(uint64_t &cursor, size_t entry_size) const {
+        if (cursor % text_capacity + entry_size > text_capacity) {
+            cursor += text_capacity - cursor % text_capacity;
+        }
+        uint32_t offset = cursor % text_capacity;
+        cursor += entry_size;
+        return offset;
+    }
+};
+
+/* Reduction that raises a channel's NEXT_MSG_ID to at least the given value.
+ *
+ * Appended posts are numbered in advance, so they can advance the counter in
+ * any order and never need to read it. */
+struct MaxMessageId {
+    typedef message_id_t LHS;
+    typedef message_id_t RHS;
+    static constexpr message_id_t identity = 0;
+
+    template <bool EXCLUSIVE>
+    static void apply(LHS &lhs, RHS rhs) {
+        fold<EXCLUSIVE>(lhs, rhs);
+    }
+
+    template <bool EXCLUSIVE>
+    static void fold(RHS &rhs1, RHS rhs2) {
+        if (EXCLUSIVE) {
+            rhs1 = std::max(rhs1, rhs2);
+            return;
+        }
+        RHS current = __atomic_load_n(&rhs1, __ATOMIC_RELAXED);
+        while (current < rhs2 &&
+               !__atomic_compare_exchange_n(&rhs1, &current, rhs2, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
 };
 
+/* Arguments of a fetch's prepare task.
+ *
+ * Users follow any number of channels, so the fetch structs below are passed
+ * serialized through their legion_* methods. The user's entries in the
+ * follows region start at first_follow. */
 struct PrepareFetchData {
+    pending_id_t pending_id;
     user_id_t user_id;
-    PerUserChannel<channel_id_t> watched_channel_ids;
+    follow_id_t first_follow;
+    std::vector<channel_id_t> watched_channel_ids;
+
+    size_t legion_buffer_size() const {
+        return sizeof pending_id + sizeof user_id + sizeof first_follow +
+               serialized_size(watched_channel_ids);
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, pending_id);
+        serialize_value(ptr, user_id);
+        serialize_value(ptr, first_follow);
+        serialize_value(ptr, watched_channel_ids);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, pending_id);
+        deserialize_value(ptr, user_id);
+        deserialize_value(ptr, first_follow);
+        deserialize_value(ptr, watched_channel_ids);
+        return ptr - (const char *)buffer;
+    }
 };
 
 struct PrepareFetchResponse {
-    PerUserChannel<message_id_t> next_unread_msg_ids;
-    PerUserChannel<message_id_t> next_channel_msg_ids;
+    std::vector<message_id_t> next_unread_msg_ids;
+    std::vector<message_id_t> next_channel_msg_ids;
+
+    size_t legion_buffer_size() const {
+        return serialized_size(next_unread_msg_ids) +
+               serialized_size(next_channel_msg_ids);
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, next_unread_msg_ids);
+        serialize_value(ptr, next_channel_msg_ids);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, next_unread_msg_ids);
+        deserialize_value(ptr, next_channel_msg_ids);
+        return ptr - (const char *)buffer;
+    }
 };
 
+/* Arguments of a fetch's execute task. Fused fetches leave the unread and
+ * next message IDs empty and read them in their task. */
 struct ExecuteFetchData {
+    pending_id_t pending_id;
     user_id_t user_id;
-    PerUserChannel<channel_id_t> watched_channel_ids;
-    PerUserChannel<message_id_t> next_unread_msg_ids;
-    PerUserChannel<message_id_t> next_channel_msg_ids;
+    follow_id_t first_follow;
+    MessageRing ring;
+    unsigned int budget;
+    std::vector<channel_id_t> watched_channel_ids;
+    std::vector<message_id_t> next_unread_msg_ids;
+    std::vector<message_id_t> next_channel_msg_ids;
+
+    size_t legion_buffer_size() const {
+        return sizeof pending_id + sizeof user_id + sizeof first_follow +
+               sizeof ring + sizeof budget +
+               serialized_size(watched_channel_ids) +
+               serialized_size(next_unread_msg_ids) +
+               serialized_size(next_channel_msg_ids);
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, pending_id);
+        serialize_value(ptr, user_id);
+        serialize_value(ptr, first_follow);
+        serialize_value(ptr, ring);
+        serialize_value(ptr, budget);
+        serialize_value(ptr, watched_channel_ids);
+        serialize_value(ptr, next_unread_msg_ids);
+        serialize_value(ptr, next_channel_msg_ids);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, pending_id);
+        deserialize_value(ptr, user_id);
+        deserialize_value(ptr, first_follow);
+        deserialize_value(ptr, ring);
+        deserialize_value(ptr, budget);
+        deserialize_value(ptr, watched_channel_ids);
+        deserialize_value(ptr, next_unread_msg_ids);
+        deserialize_value(ptr, next_channel_msg_ids);
+        return ptr - (const char *)buffer;
+    }
+
+    /* Messages of each watched channel that the fetch returns.
+     *
+     * The budget goes out one message at a time to the channels that have
+     * more, so a busy channel cannot starve the others. The channel served
+     * first moves on as the user reads, spreading any remainder evenly. */
+    void ranges(std::vector<message_id_t> &first,
+                std::vector<message_id_t> &last) {
+        size_t n_channels = watched_channel_ids.size();
+        first.resize(n_channels);
+        last.resize(n_channels);
+        message_id_t progress = 0;
+        for (size_t i = 0; i < n_channels; i++) {
+            first[i] = ring.first_retained(next_unread_msg_ids[i],
+                                           next_channel_msg_ids[i]);
+            last[i] = first[i];
+            progress += next_unread_msg_ids[i];
+        }
+        unsigned int remaining = budget;
+        size_t start = n_channels == 0 ? 0 : progress % n_channels;
+        bool served = true;
+        while (remaining != 0 && served) {
+            served = false;
+            for (size_t k = 0; k < n_channels && remaining != 0; k++) {
+                size_t i = (start + k) % n_channels;
+                if (last[i] != next_channel_msg_ids[i]) {
+                    last[i]++;
+                    remaining--;
+                    served = true;
+                }
+            }
+        }
+    }
 };
 
+/* Result of a fetch, with the messages of all channels in timestamp order.
+ *
+ * Legion serializes this through the legion_* methods, so the future only
+ * carries the returned messages, each with its text trimmed to its length. */
 struct ExecuteFetchResponse {
     bool success;
-    message_id_t num_messages;
-    MessageList messages;
+    // Whether the fetch went through all messages posted before it, rather
+    // than stopping at its budget. Expired messages count against the budget
+    // without being returned, so the number returned cannot tell.
+    bool caught_up = false;
+    std::vector<Message> messages;
+
+    // Message fields other than the text, plus the text length.
+    static constexpr size_t MESSAGE_HEADER_SIZE =
+        sizeof(message_id_t) + sizeof(user_id_t) + sizeof(time_t) +
+        sizeof(uint16_t);
+    // Largest budget whose results fit in a future even with full texts.
+    static constexpr unsigned int MAX_MESSAGES =
+        (LEGION_MAX_RETURN_SIZE - 2 * sizeof(bool) - sizeof(message_id_t)) /
+        (MESSAGE_HEADER_SIZE + MESSAGE_LENGTH - 1);
+
+    size_t legion_buffer_size() const {
+        size_t size = sizeof success + sizeof caught_up + sizeof(message_id_t);
+        for (const Message &msg : messages) {
+            size += MESSAGE_HEADER_SIZE + msg.text.length();
+        }
+        return size;
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, success);
+        serialize_value(ptr, caught_up);
+        serialize_value(ptr, (message_id_t)messages.size());
+        for (const Message &msg : messages) {
+            uint16_t length = msg.text.length();
+            serialize_value(ptr, msg.message_id);
+            serialize_value(ptr, msg.author_id);
+            serialize_value(ptr, msg.timestamp);
+            serialize_value(ptr, length);
+            memcpy(ptr, msg.text.c_str(), length);
+            ptr += length;
+        }
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        message_id_t num_messages;
+        deserialize_value(ptr, success);
+        deserialize_value(ptr, caught_up);
+        deserialize_value(ptr, num_messages);
+        messages.resize(num_messages);
+        for (Message &msg : messages) {
+            uint16_t length;
+            deserialize_value(ptr, msg.message_id);
+            deserialize_value(ptr, msg.author_id);
+            deserialize_value(ptr, msg.timestamp);
+            deserialize_value(ptr, length);
+            memcpy(msg.text, ptr, length);
+            msg.text[length] = '\0';
+            ptr += length;
+        }
+        return ptr - (const char *)buffer;
+    }
 };
 
+static_assert(MAX_RETURNED_MESSAGES <= ExecuteFetchResponse::MAX_MESSAGES,
+              "default fetch results must fit in a future");
+
 struct PreparePostData {
+    pending_id_t pending_id;
     channel_id_t channel_id;
 };
 
@@ -124,14 +521,94 @@ struct PreparePostResponse {
     message_id_t next_channel_msg_id;
 };
 
+/* Arguments of a post.
+ *
+ * Launches pass this serialized through the legion_* methods, like
+ * ExecuteFetchResponse, so only the used bytes of the text are copied. */
 struct ExecutePostData {
+    pending_id_t pending_id;
+    MessageRing ring;
     channel_id_t channel_id;
+    // Whether to take the next message ID instead of checking it.
+    bool assign_id;
     message_id_t next_channel_msg_id;
+    // Arena offset of the text, unless it is inlined.
+    uint32_t text_offset;
     Message message;
+
+    size_t legion_buffer_size() const {
+        return sizeof pending_id + sizeof ring + sizeof channel_id +
+               sizeof assign_id + sizeof next_channel_msg_id +
+               sizeof text_offset + ExecuteFetchResponse::MESSAGE_HEADER_SIZE +
+               message.text.length();
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        uint16_t length = message.text.length();
+        serialize_value(ptr, pending_id);
+        serialize_value(ptr, ring);
+        serialize_value(ptr, channel_id);
+        serialize_value(ptr, assign_id);
+        serialize_value(ptr, next_channel_msg_id);
+        serialize_value(ptr, text_offset);
+        serialize_value(ptr, message.message_id);
+        serialize_value(ptr, message.author_id);
+        serialize_value(ptr, message.timestamp);
+        serialize_value(ptr, length);
+        memcpy(ptr, message.text.c_str(), length);
+        ptr += length;
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        uint16_t length;
+        deserialize_value(ptr, pending_id);
+        deserialize_value(ptr, ring);
+        deserialize_value(ptr, channel_id);
+        deserialize_value(ptr, assign_id);
+        deserialize_value(ptr, next_channel_msg_id);
+        deserialize_value(ptr, text_offset);
+        deserialize_value(ptr, message.message_id);
+        deserialize_value(ptr, message.author_id);
+        deserialize_value(ptr, message.timestamp);
+        deserialize_value(ptr, length);
+        memcpy(message.text, ptr, length);
+        message.text[length] = '\0';
+        ptr += length;
+        return ptr - (const char *)buffer;
+    }
 };
 
 struct ExecutePostResponse {
     bool success;
+    // Whether the post failed because the channel had no free slot.
+    bool full;
+    message_id_t message_id;
+    // Timestamp of the stored message, for the inbox entries that refer to
+    // it.
+    time_t timestamp;
+};
+
+/* Entries that a delivery appends to the inbox of the user at its point, in
+ * order. Launches pass this serialized through the legion_* methods. */
+struct DeliverData {
+    std::vector<InboxEntry> entries;
+
+    size_t legion_buffer_size() const { return serialized_size(entries); }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, entries);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, entries);
+        return ptr - (const char *)buffer;
+    }
 };
 
 enum Action {
@@ -139,11 +616,26 @@ enum Action {
     FETCH,
 };
 
+/* A request of a client. Posts send msg_template filled in with their user
+ * and channel, so the text is only made when the post is launched. */
 struct Request {
     Action action;
     user_id_t user_id;
     channel_id_t channel_id;
-    MessageText message;
+    // Number of earlier executions that failed validation.
+    unsigned int attempt;
+    // When the request arrived, and when the dispatcher launched the first
+    // task of its current attempt, saw its prepare task finish and launched
+    // its execute task.
+    std::chrono::high_resolution_clock::time_point arrival;
+    std::chrono::high_resolution_clock::time_point launched;
+    std::chrono::high_resolution_clock::time_point prepared;
+    std::chrono::high_resolution_clock::time_point executing;
+    // Text of a replayed post, instead of msg_template if not null.
+    const char *text;
+    uint16_t text_length;
+    // Sum of the versions of a fetch's channels when it was last launched.
+    uint64_t channel_versions;
 };
 
 struct PendingRequest {
@@ -151,388 +643,3610 @@ struct PendingRequest {
     Request request;
 };
 
-const struct option options[] = {
-    {.name = "n", .has_arg = required_argument, .flag = NULL, .val = 'n'},
-    {.name = "k", .has_arg = required_argument, .flag = NULL, .val = 'k'},
-    {.name = "m", .has_arg = required_argument, .flag = NULL, .val = 'm'},
-    {.name = "t", .has_arg = required_argument, .flag = NULL, .val = 't'},
-    {.name = "r", .has_arg = required_argument, .flag = NULL, .val = 'r'},
-    {0, 0, 0, 0},
+/* Requests of the same kind launched together as one index task.
+ *
+ * Points of the launch are user IDs for fetches and channel IDs for posts, so
+ * every request in a batch has a distinct key. */
+struct PendingBatch {
+    Legion::FutureMap futures;
+    Action action;
+    std::vector<Request> requests;
+    Legion::IndexSpace launch_space;
+    // Number of points whose current task has not finished yet.
+    size_t n_running;
 };
 
-unsigned long long fetch_time;
-unsigned long long fetch_count;
-unsigned long long fetch_message_count;
-unsigned long long post_time;
-unsigned long long post_count;
+// Point of a batched launch that handles the given request.
+Legion::DomainPoint batch_point(const Request &request) {
+    return Legion::DomainPoint(request.action == FETCH ? request.user_id
+                                                       : request.channel_id);
+}
 
-void dispatch_task(const Legion::Task *task,
-                   const std::vector<Legion::PhysicalRegion> &regions,
-                   Legion::Context ctx, Legion::Runtime *runtime) {
-    const Legion::InputArgs &args = Legion::Runtime::get_input_args();
-    user_id_t user_count = 0;
-    channel_id_t channel_count = 0;
-    message_id_t msg_count = 0;
-    unsigned long n_requests = 0;
-    unsigned int request_ratio = 1;
+// Task data is per-point for index launches and global otherwise.
+const void *task_args(const Legion::Task *task) {
+    return task->is_index_space ? task->local_args : task->args;
+}
 
-    int opt;
-    opterr = 0;
-    while ((opt = getopt_long_only(args.argc, args.argv, "", options, NULL)) !=
-           -1) {
-        switch (opt) {
-        case 'n':
-            user_count = atoi(optarg);
-            break;
-        case 'k':
-            channel_count = atoi(optarg);
-            break;
-        case 'm':
-            msg_count = atoi(optarg);
-            break;
-        case 't':
-            n_requests = atol(optarg);
-            break;
-        case 'r':
-            request_ratio = atoi(optarg);
-            break;
-        case '?':
-        default:
-            break;
+template <typename T>
+T *task_data(const Legion::Task *task) {
+    return (T *)task_args(task);
+}
+
+// Buffer holding the value serialized through its legion_* methods.
+template <typename T>
+std::vector<char> serialized(const T &value) {
+    std::vector<char> buffer(value.legion_buffer_size());
+    buffer.resize(value.legion_serialize(buffer.data()));
+    return buffer;
+}
+
+// Most dispatchers that can split the requests. Each numbers its pending IDs
+// from its index on in steps of this, and has its own completion queues.
+constexpr unsigned int MAX_DISPATCHERS = 64;
+
+// Index of the dispatcher that gave out the pending ID.
+unsigned int dispatcher_index(pending_id_t id) { return id % MAX_DISPATCHERS; }
+
+/* Wakes up a dispatcher that has nothing to do. Its tasks ring it as they
+ * finish and the producer as requests arrive, so it sleeps instead of
+ * spinning. A ring before the wait is not lost. */
+class Doorbell {
+private:
+    std::mutex mutex;
+    std::condition_variable rung;
+    bool ringing = false;
+
+public:
+    void ring() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ringing = true;
         }
+        rung.notify_one();
     }
 
-    // Check that (nonzero) arguments are given.
-    if (user_count == 0 || channel_count == 0 || msg_count == 0 ||
-        n_requests == 0 || request_ratio == 0) {
-        std::cerr << "Usage: " << args.argv[0]
-                  << " [-n num_users] [-k num_channels] [-m num_messages] [-t "
-                     "test_requests] [-r test_request_ratio]"
-                  << std::endl;
-        exit(EXIT_FAILURE);
+    // Block until a ring since the last wait returned.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        rung.wait(lock, [this] { return ringing; });
+        ringing = false;
     }
+};
 
-    // Check that we have enough channels to choose from.
-    if (channel_count < CHANNELS_PER_USER) {
-        std::cerr << "You must specify at least " << CHANNELS_PER_USER
-                  << " channels" << std::endl;
-        exit(EXIT_FAILURE);
+Doorbell doorbells[MAX_DISPATCHERS];
+
+/* Queue of pending requests whose current task has finished.
+ *
+ * Tasks push their pending ID just before returning, so the dispatcher only
+ * has to look at requests that are (about to be) ready instead of polling
+ * every outstanding future. This relies on all tasks sharing the address space
+ * of the dispatcher, so dispatchers spanning several nodes complete requests in
+ * launch order instead. */
+class CompletionQueue {
+private:
+    std::mutex mutex;
+    std::vector<pending_id_t> ids;
+
+public:
+    // Queue the ID and wake up the dispatcher that gave it out.
+    void push(pending_id_t id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ids.push_back(id);
+        }
+        doorbells[dispatcher_index(id)].ring();
     }
 
-    unsigned long n_post_requests = n_requests / (request_ratio + 1);
-    unsigned long n_fetch_requests = n_post_requests * request_ratio;
+    // Move all queued IDs into out (which is cleared first).
+    void drain(std::vector<pending_id_t> &out) {
+        out.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(out, ids);
+    }
+};
 
-    // Check that we will have at lest one request.
-    if (n_post_requests == 0) {
-        std::cerr
-            << "The number of requests is too low for the chosen ratio.\n"
-            << "Please increase the number of requests or decrease the ratio."
-            << std::endl;
-        exit(EXIT_FAILURE);
+CompletionQueue prepared_reqs[MAX_DISPATCHERS];
+CompletionQueue executed_reqs[MAX_DISPATCHERS];
+
+class RequestQueue;
+
+// Arrival queue of each dispatcher, while a RequestRouter holds them. Like
+// the completion queues, this relies on dispatchers sharing the address space
+// of the producer.
+RequestQueue *arrival_queues[MAX_DISPATCHERS];
+
+constexpr size_t REQUEST_QUEUE_CAPACITY = 4096;
+
+/* Bounded lock-free queue of arrived requests, from one producer thread to
+ * the dispatcher. The producer closes it after its last request. */
+class RequestQueue {
+private:
+    Request slots[REQUEST_QUEUE_CAPACITY];
+    // Positions of the next pop and push, counting all requests so far.
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> closed{false};
+
+public:
+    bool try_push(const Request &request) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) ==
+            REQUEST_QUEUE_CAPACITY) {
+            return false;
+        }
+        slots[t % REQUEST_QUEUE_CAPACITY] = request;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
     }
 
-    std::default_random_engine rng;
+    bool try_pop(Request &request) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        request = slots[h % REQUEST_QUEUE_CAPACITY];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
 
-    /* Users array. */
-    Legion::Rect<1> user_id_range(0, user_count);
-    Legion::IndexSpaceT<1> user_ids =
-        runtime->create_index_space(ctx, user_id_range);
-    Legion::IndexPartition user_id_partition =
-        runtime->create_equal_partition(ctx, user_ids, user_ids);
-    Legion::FieldSpace user_fields = runtime->create_field_space(ctx);
-    Legion::FieldAllocator allocator =
-        runtime->create_field_allocator(ctx, user_fields);
-    allocator.allocate_field(CHANNELS_PER_USER * sizeof(channel_id_t),
-                             FOLLOWED_CHANNEL_IDS);
-    Legion::LogicalRegionT<1> users =
-        runtime->create_logical_region(ctx, user_ids, user_fields);
-    // Initialize array.
-    Legion::RegionRequirement user_init_req(users, WRITE_DISCARD, EXCLUSIVE,
-                                            users);
-    user_init_req.add_field(FOLLOWED_CHANNEL_IDS);
-    Legion::InlineLauncher user_init_launcher(user_init_req);
-    Legion::PhysicalRegion init_region =
-        runtime->map_region(ctx, user_init_launcher);
-    const Legion::FieldAccessor<WRITE_DISCARD, PerUserChannel<channel_id_t>, 1>
-        channel_id_mem(init_region, FOLLOWED_CHANNEL_IDS);
-    std::vector<channel_id_t> all_channel_ids(channel_count);
-    std::iota(all_channel_ids.begin(), all_channel_ids.end(), 0);
-    for (Legion::PointInRectIterator<1> iter(user_id_range); iter(); iter++) {
-        std::shuffle(all_channel_ids.begin(), all_channel_ids.end(), rng);
-        channel_id_mem[*iter] =
-            PerUserChannel<channel_id_t>(&all_channel_ids[0]);
-    }
-    // Leave this region mapped.
-
-    /* Next unread array. */
-    Legion::FieldSpace next_unread_fields = runtime->create_field_space(ctx);
-    allocator = runtime->create_field_allocator(ctx, next_unread_fields);
-    allocator.allocate_field(CHANNELS_PER_USER * sizeof(message_id_t),
-                             NEXT_UNREAD_MSG_IDS);
-    Legion::LogicalRegionT<1> next_unreads =
-        runtime->create_logical_region(ctx, user_ids, next_unread_fields);
-    Legion::LogicalPartition next_unread_partition =
-        runtime->get_logical_partition(next_unreads, user_id_partition);
-    // Initialize array.
-    Legion::RegionRequirement next_unread_init_req(next_unreads, WRITE_DISCARD,
-                                                   EXCLUSIVE, next_unreads);
-    next_unread_init_req.add_field(NEXT_UNREAD_MSG_IDS);
-    Legion::InlineLauncher next_unread_init_launcher(next_unread_init_req);
-    init_region = runtime->map_region(ctx, next_unread_init_launcher);
-    const Legion::FieldAccessor<WRITE_DISCARD, PerUserChannel<message_id_t>, 1>
-        next_unread_mem(init_region, NEXT_UNREAD_MSG_IDS);
-    for (Legion::PointInRectIterator<1> iter(user_id_range); iter(); iter++) {
-        next_unread_mem[*iter] = PerUserChannel<message_id_t>();
-    }
-    runtime->unmap_region(ctx, init_region);
-
-    /* Channels array. */
-    Legion::Rect<1> channel_id_range(0, channel_count);
-    Legion::IndexSpaceT<1> channel_ids =
-        runtime->create_index_space(ctx, channel_id_range);
-    Legion::IndexPartition channel_id_partition =
-        runtime->create_equal_partition(ctx, channel_ids, channel_ids);
-    Legion::FieldSpace channel_fields = runtime->create_field_space(ctx);
-    allocator = runtime->create_field_allocator(ctx, channel_fields);
-    allocator.allocate_field(sizeof(message_id_t), NEXT_MSG_ID);
-    Legion::LogicalRegionT<1> channels =
-        runtime->create_logical_region(ctx, channel_ids, channel_fields);
-    Legion::LogicalPartition channel_partition =
-        runtime->get_logical_partition(channels, channel_id_partition);
-    // Initialize array.
-    Legion::RegionRequirement init_req(channels, WRITE_DISCARD, EXCLUSIVE,
-                                       channels);
-    init_req.add_field(NEXT_MSG_ID);
-    Legion::InlineLauncher init_launcher(init_req);
-    init_region = runtime->map_region(ctx, init_launcher);
-    const Legion::FieldAccessor<WRITE_DISCARD, message_id_t, 1> next_msg(
-        init_region, NEXT_MSG_ID);
-    for (Legion::PointInRectIterator<1> iter(channel_id_range); iter();
-         iter++) {
-        next_msg[*iter] = 0;
+    void close() { closed.store(true, std::memory_order_release); }
+
+    // Whether no request is left and none will come.
+    bool drained() const {
+        return closed.load(std::memory_order_acquire) &&
+               head.load(std::memory_order_relaxed) ==
+                   tail.load(std::memory_order_acquire);
     }
-    runtime->unmap_region(ctx, init_region);
+};
 
-    /* Messages array. */
-    Legion::Rect<2> msg_id_range(Legion::Point<2>(0, 0),
-                                 Legion::Point<2>(channel_count, msg_count));
-    Legion::IndexSpaceT<2> msg_ids =
-        runtime->create_index_space(ctx, msg_id_range);
-    Legion::IndexPartition msg_id_partition =
-        runtime->create_equal_partition(ctx, msg_ids, msg_ids);
-    Legion::FieldSpace msg_fields = runtime->create_field_space(ctx);
-    allocator = runtime->create_field_allocator(ctx, msg_fields);
-    allocator.allocate_field(sizeof(user_id_t), AUTHOR_ID);
-    allocator.allocate_field(sizeof(time_t), TIMESTAMP);
-    allocator.allocate_field(sizeof(MessageText), TEXT);
-    Legion::LogicalRegionT<2> messages =
-        runtime->create_logical_region(ctx, msg_ids, msg_fields);
-    Legion::LogicalPartition message_partition =
-        runtime->get_logical_partition(messages, msg_id_partition);
+/* Queues of arrived requests, one for each dispatcher. Fetches go to the
+ * dispatcher of their user and posts to that of their channel, by ID, so each
+ * user's fetches and each channel's posts go through the same one. */
+class RequestRouter {
+private:
+    std::vector<std::unique_ptr<RequestQueue>> queues;
 
-    /* Generate random requests. */
-    std::deque<Request> requests;
-    auto random_user_id = std::bind(
-        std::uniform_int_distribution(user_id_t(0), user_id_t(user_count - 1)),
-        rng);
-    for (unsigned long i = 0; i < n_fetch_requests; i++) {
-        requests.push_back({.action = FETCH, .user_id = random_user_id()});
-    }
-    auto random_watched_ix = std::bind(
-        std::uniform_int_distribution(0U, CHANNELS_PER_USER - 1), rng);
-    for (unsigned long i = 0; i < n_post_requests; i++) {
-        Request req = {.action = POST, .user_id = random_user_id()};
-        req.channel_id =
-            ((PerUserChannel<channel_id_t>)
-                 channel_id_mem[req.user_id])[random_watched_ix()];
-        snprintf(req.message, MESSAGE_LENGTH, msg_template, req.user_id,
-                 req.channel_id);
-        requests.push_back(req);
-    }
-    std::shuffle(requests.begin(), requests.end(), rng);
-
-    /* Statistics. */
-    unsigned long n_failed_fetch = 0;
-    unsigned long n_failed_post = 0;
+public:
+    explicit RequestRouter(unsigned int n_queues) {
+        for (unsigned int i = 0; i < n_queues; i++) {
+            queues.push_back(std::make_unique<RequestQueue>());
+            arrival_queues[i] = queues.back().get();
+        }
+    }
 
-    /* Execute requests. */
-    std::list<PendingRequest> pending_reqs;
-    std::vector<PendingRequest> executing_reqs;
-    auto start = std::chrono::high_resolution_clock::now();
-    time_t time = 0;
-    while (requests.size() != 0 || pending_reqs.size() != 0) {
-        for (auto it = pending_reqs.begin(); it != pending_reqs.end(); it++) {
-            auto &req = *it;
-            if (req.future.is_ready()) {
-                switch (req.request.action) {
-                case FETCH: {
-                    PrepareFetchResponse response =
-                        req.future.get_result<PrepareFetchResponse>();
-                    ExecuteFetchData data = {.user_id = req.request.user_id};
-                    memcpy(data.watched_channel_ids,
-                           (PerUserChannel<channel_id_t>)
-                               channel_id_mem[req.request.user_id],
-                           sizeof data.watched_channel_ids);
-                    memcpy(data.next_channel_msg_ids,
-                           response.next_channel_msg_ids,
-                           sizeof data.next_channel_msg_ids);
-                    memcpy(data.next_unread_msg_ids,
-                           response.next_unread_msg_ids,
-                           sizeof data.next_unread_msg_ids);
-                    Legion::TaskLauncher launcher(
-                        EXECUTE_FETCH_TASK,
-                        Legion::TaskArgument(&data, sizeof(ExecuteFetchData)));
-                    launcher.add_region_requirement(Legion::RegionRequirement(
-                        runtime->get_logical_subregion_by_color(
-                            next_unread_partition, req.request.user_id),
-                        READ_WRITE, EXCLUSIVE, next_unreads));
-                    launcher.add_field(0, NEXT_UNREAD_MSG_IDS);
-                    unsigned long reqid = 1;
-                    for (unsigned int i = 0; i < CHANNELS_PER_USER; i++) {
-                        for (message_id_t j = data.next_unread_msg_ids[i];
-                             j < data.next_channel_msg_ids[i]; j++, reqid++) {
-                            launcher.add_region_requirement(
-                                Legion::RegionRequirement(
-                                    runtime->get_logical_subregion_by_color(
-                                        message_partition,
-                                        Legion::Point<2>(
-                                            data.watched_channel_ids[i], j)),
-                                    READ_ONLY, EXCLUSIVE, messages));
-                            launcher.add_field(reqid, NEXT_MSG_ID);
-                        }
-                    }
-                    executing_reqs.push_back(
-                        {.future = runtime->execute_task(ctx, launcher),
-                         .request = req.request});
-                    break;
-                }
-                case POST: {
-                    PreparePostResponse response =
-                        req.future.get_result<PreparePostResponse>();
-                    Message msg = {
-                        .message_id = response.next_channel_msg_id,
-                        .author_id = req.request.user_id,
-                        .timestamp = time,
-                    };
-                    memcpy(msg.text, req.request.message, sizeof msg.text);
-                    time++;
-                    ExecutePostData data = {
-                        .channel_id = req.request.channel_id,
-                        .next_channel_msg_id = response.next_channel_msg_id,
-                        .message = msg};
-                    Legion::TaskLauncher launcher(
-                        EXECUTE_POST_TASK,
-                        Legion::TaskArgument(&data, sizeof(ExecutePostData)));
-                    launcher.add_region_requirement(Legion::RegionRequirement(
-                        runtime->get_logical_subregion_by_color(
-                            channel_partition, req.request.channel_id),
-                        READ_WRITE, EXCLUSIVE, channels));
-                    launcher.add_field(0, NEXT_MSG_ID);
-                    launcher.add_region_requirement(Legion::RegionRequirement(
-                        runtime->get_logical_subregion_by_color(
-                            message_partition,
-                            Legion::Point<2>(req.request.channel_id,
-                                             response.next_channel_msg_id)),
-                        WRITE_DISCARD, EXCLUSIVE, messages));
-                    launcher.add_field(1, AUTHOR_ID);
-                    launcher.add_field(1, TIMESTAMP);
-                    launcher.add_field(1, TEXT);
-                    executing_reqs.push_back(
-                        {.future = runtime->execute_task(ctx, launcher),
-                         .request = req.request});
-                    break;
-                }
-                }
-                pending_reqs.erase(it);
-                break;
-            }
+    ~RequestRouter() {
+        for (unsigned int i = 0; i < queues.size(); i++) {
+            arrival_queues[i] = nullptr;
         }
+    }
 
-        if (requests.size() == 0) {
-            continue;
+    RequestQueue &queue(unsigned int i) { return *queues[i]; }
+
+    // Queue the request and wake up its dispatcher.
+    bool try_push(const Request &request) {
+        unsigned int i = batch_point(request)[0] % queues.size();
+        if (!queues[i]->try_push(request)) {
+            return false;
         }
-        Request &request = requests.front();
-        switch (request.action) {
+        doorbells[i].ring();
+        return true;
+    }
+
+    void close() {
+        for (unsigned int i = 0; i < queues.size(); i++) {
+            queues[i]->close();
+            doorbells[i].ring();
+        }
+    }
+};
+
+/* Binary request trace: a TraceHeader, then a TraceRecord for each request,
+ * then the texts of all posts, which records point into. */
+constexpr char TRACE_MAGIC[8] = {'M', 'S', 'G', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 1;
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    user_id_t user_count;
+    channel_id_t channel_count;
+    uint64_t n_fetch_requests;
+    uint64_t n_post_requests;
+    uint64_t text_bytes;
+};
+
+struct TraceRecord {
+    // Arrival time after the start of the trace, or 0 for immediately.
+    uint64_t arrival_ns;
+    uint32_t text_offset;
+    uint16_t text_length;
+    user_id_t user_id;
+    channel_id_t channel_id;
+    uint8_t action;
+};
+
+// Collects the requests of a run in memory and writes them as a trace.
+class TraceRecorder {
+public:
+    void add(const Request &request, uint64_t arrival_ns) {
+        // Zero the padding too, which gets written.
+        TraceRecord record;
+        memset(&record, 0, sizeof record);
+        record.arrival_ns = arrival_ns;
+        record.text_offset = (uint32_t)texts.size();
+        record.user_id = request.user_id;
+        record.channel_id = request.channel_id;
+        record.action = (uint8_t)request.action;
+        if (request.action == POST) {
+            char text[MESSAGE_LENGTH];
+            record.text_length =
+                std::min<int>(snprintf(text, MESSAGE_LENGTH, msg_template,
+                                       request.user_id, request.channel_id),
+                              MESSAGE_LENGTH - 1);
+            texts.append(text, record.text_length);
+        }
+        records.push_back(record);
+    }
+
+    void write(const char *path, user_id_t user_count,
+               channel_id_t channel_count) const {
+        TraceHeader header;
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+        header.version = TRACE_VERSION;
+        header.user_count = user_count;
+        header.channel_count = channel_count;
+        header.text_bytes = texts.size();
+        for (const TraceRecord &record : records) {
+            if (record.action == FETCH) {
+                header.n_fetch_requests++;
+            } else {
+                header.n_post_requests++;
+            }
+        }
+        FILE *file = fopen(path, "wb");
+        if (file == NULL ||
+            fwrite(&header, sizeof header, 1, file) != 1 ||
+            fwrite(records.data(), sizeof(TraceRecord), records.size(),
+                   file) != records.size() ||
+            fwrite(texts.data(), 1, texts.size(), file) != texts.size() ||
+            fclose(file) != 0) {
+            std::cerr << "Cannot write trace " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+private:
+    std::vector<TraceRecord> records;
+    std::string texts;
+};
+
+/* Source that replays a trace, mapped into memory before the run so that
+ * requests are read in place. */
+class TraceReplayer {
+public:
+    TraceReplayer(const char *path) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Cannot open trace " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size = st.st_size;
+        data = size < sizeof(TraceHeader)
+                   ? MAP_FAILED
+                   : mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                          fd, 0);
+        close(fd);
+        const TraceHeader *h = (const TraceHeader *)data;
+        // Bounding the counts first keeps the size from overflowing.
+        uint64_t max_records =
+            (size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        if (data == MAP_FAILED ||
+            memcmp(h->magic, TRACE_MAGIC, sizeof h->magic) != 0 ||
+            h->version != TRACE_VERSION ||
+            h->n_fetch_requests > max_records ||
+            h->n_post_requests > max_records - h->n_fetch_requests ||
+            size != sizeof(TraceHeader) +
+                        (h->n_fetch_requests + h->n_post_requests) *
+                            sizeof(TraceRecord) +
+                        h->text_bytes) {
+            std::cerr << "Invalid trace " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        check_records(path);
+    }
+
+    ~TraceReplayer() { munmap(data, size); }
+
+    /* Check that every record is a request of the trace's users and channels
+     * whose text lies in the texts, and fits in a message, before the run
+     * trusts them. */
+    void check_records(const char *path) const {
+        const TraceHeader &h = header();
+        const TraceRecord *records = (const TraceRecord *)(&h + 1);
+        size_t n_records = h.n_fetch_requests + h.n_post_requests;
+        for (size_t i = 0; i < n_records; i++) {
+            const TraceRecord &record = records[i];
+            const char *problem = NULL;
+            if (record.action != POST && record.action != FETCH) {
+                problem = "unknown action";
+            } else if (record.user_id >= h.user_count) {
+                problem = "user out of range";
+            } else if (record.channel_id >= h.channel_count) {
+                problem = "channel out of range";
+            } else if (record.text_length >= MESSAGE_LENGTH) {
+                problem = "text too long";
+            } else if ((uint64_t)record.text_offset + record.text_length >
+                       h.text_bytes) {
+                problem = "text out of range";
+            }
+            if (problem != NULL) {
+                std::cerr << "Invalid trace " << path << ": record " << i
+                          << ", " << problem << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    const TraceHeader &header() const { return *(const TraceHeader *)data; }
+
+    // Push the requests to their queues at their recorded times, then close
+    // them.
+    void run(RequestRouter &queues) {
+        const TraceHeader &h = header();
+        const TraceRecord *records = (const TraceRecord *)(&h + 1);
+        size_t n_records = h.n_fetch_requests + h.n_post_requests;
+        const char *texts = (const char *)(records + n_records);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < n_records; i++) {
+            const TraceRecord &record = records[i];
+            Request request = {.action = (Action)record.action,
+                               .user_id = record.user_id,
+                               .channel_id = record.channel_id,
+                               .attempt = 0,
+                               .text = texts + record.text_offset,
+                               .text_length = record.text_length};
+            request.arrival = std::chrono::high_resolution_clock::now();
+            if (record.arrival_ns != 0) {
+                request.arrival = start + std::chrono::nanoseconds(
+                                              record.arrival_ns);
+                std::this_thread::sleep_until(request.arrival);
+            }
+            while (!queues.try_push(request)) {
+                std::this_thread::yield();
+            }
+        }
+        queues.close();
+    }
+
+private:
+    void *data;
+    size_t size;
+};
+
+const struct option options[] = {
+    {.name = "n", .has_arg = required_argument, .flag = NULL, .val = 'n'},
+    {.name = "k", .has_arg = required_argument, .flag = NULL, .val = 'k'},
+    {.name = "m", .has_arg = required_argument, .flag = NULL, .val = 'm'},
+    {.name = "t", .has_arg = required_argument, .flag = NULL, .val = 't'},
+    {.name = "r", .has_arg = required_argument, .flag = NULL, .val = 'r'},
+    {.name = "b", .has_arg = required_argument, .flag = NULL, .val = 'b'},
+    {.name = "g", .has_arg = required_argument, .flag = NULL, .val = 'g'},
+    {.name = "c", .has_arg = required_argument, .flag = NULL, .val = 'c'},
+    {.name = "x", .has_arg = required_argument, .flag = NULL, .val = 'x'},
+    {.name = "p", .has_arg = required_argument, .flag = NULL, .val = 'p'},
+    {.name = "w", .has_arg = required_argument, .flag = NULL, .val = 'w'},
+    {.name = "a", .has_arg = required_argument, .flag = NULL, .val = 'a'},
+    {.name = "l", .has_arg = required_argument, .flag = NULL, .val = 'l'},
+    {.name = "o", .has_arg = required_argument, .flag = NULL, .val = 'o'},
+    {.name = "f", .has_arg = required_argument, .flag = NULL, .val = 'f'},
+    {.name = "e", .has_arg = required_argument, .flag = NULL, .val = 'e'},
+    {.name = "u", .has_arg = required_argument, .flag = NULL, .val = 'u'},
+    {.name = "q", .has_arg = required_argument, .flag = NULL, .val = 'q'},
+    {.name = "d", .has_arg = required_argument, .flag = NULL, .val = 'd'},
+    {.name = "s", .has_arg = required_argument, .flag = NULL, .val = 's'},
+    {.name = "j", .has_arg = no_argument, .flag = NULL, .val = 'j'},
+    {.name = "i", .has_arg = required_argument, .flag = NULL, .val = 'i'},
+    {.name = "y", .has_arg = required_argument, .flag = NULL, .val = 'y'},
+    {.name = "v", .has_arg = required_argument, .flag = NULL, .val = 'v'},
+    {.name = "z", .has_arg = required_argument, .flag = NULL, .val = 'z'},
+    {.name = "h", .has_arg = required_argument, .flag = NULL, .val = 'h'},
+    {.name = "C", .has_arg = required_argument, .flag = NULL, .val = 'C'},
+    {.name = "P", .has_arg = required_argument, .flag = NULL, .val = 'P'},
+    {.name = "R", .has_arg = required_argument, .flag = NULL, .val = 'R'},
+    {.name = "H", .has_arg = no_argument, .flag = NULL, .val = 'H'},
+    {.name = "D", .has_arg = required_argument, .flag = NULL, .val = 'D'},
+    {.name = "K", .has_arg = required_argument, .flag = NULL, .val = 'K'},
+    {.name = "Q", .has_arg = required_argument, .flag = NULL, .val = 'Q'},
+    {.name = "W", .has_arg = required_argument, .flag = NULL, .val = 'W'},
+    {0, 0, 0, 0},
+};
+
+/* Per-task trace messages.
+ *
+ * These are logged at debug level, which is compiled out unless the Makefile's
+ * OUTPUT_LEVEL is LEVEL_DEBUG or lower. A build that includes them prints them
+ * when run with -level messaging=1. */
+Legion::Logger log_messaging("messaging");
+
+/* Log-linear histogram of latencies in nanoseconds.
+ *
+ * Values below SUB_BUCKETS are counted exactly; larger values fall into one of
+ * SUB_BUCKETS / 2 buckets per power of two, so quantiles are accurate to about
+ * 3%. */
+class LatencyHistogram {
+private:
+    static constexpr unsigned int SUB_BUCKET_BITS = 5;
+    static constexpr unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr unsigned int HALF_BUCKETS = SUB_BUCKETS / 2;
+    static constexpr unsigned int BUCKETS =
+        (64 - SUB_BUCKET_BITS + 1) * HALF_BUCKETS + HALF_BUCKETS;
+
+    unsigned long long counts[BUCKETS] = {};
+    unsigned long long n = 0;
+    unsigned long long sum = 0;
+
+    static unsigned int shift_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return 0;
+        }
+        return 63 - __builtin_clzll(value) - (SUB_BUCKET_BITS - 1);
+    }
+
+    static unsigned int bucket_of(uint64_t value) {
+        unsigned int shift = shift_of(value);
+        return shift * HALF_BUCKETS + (value >> shift);
+    }
+
+    // Largest value that falls into the given bucket.
+    static uint64_t bucket_max(unsigned int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        unsigned int shift = bucket / HALF_BUCKETS - 1;
+        uint64_t top = bucket - shift * HALF_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+
+public:
+    void record(uint64_t value) {
+        counts[bucket_of(value)]++;
+        n++;
+        sum += value;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        n += other.n;
+        sum += other.sum;
+    }
+
+    unsigned long long count() const { return n; }
+    unsigned long long total() const { return sum; }
+
+    // Write the bounds and count of each nonempty bucket as CSV rows.
+    void write_csv(std::ostream &out, const std::string &label) const {
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            if (counts[i] != 0) {
+                out << label << "," << (i == 0 ? 0 : bucket_max(i - 1) + 1)
+                    << "," << bucket_max(i) << "," << counts[i] << "\n";
+            }
+        }
+    }
+
+    // Smallest bucket bound such that a fraction q of values is at most it.
+    uint64_t quantile(double q) const {
+        unsigned long long rank = std::max(1ULL, (unsigned long long)(q * n));
+        unsigned long long seen = 0;
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return bucket_max(i);
+            }
+        }
+        return 0;
+    }
+};
+
+enum TaskKind {
+    FETCH_PREPARE,
+    FETCH_EXECUTE,
+    POST_PREPARE,
+    POST_EXECUTE,
+    POST_DELIVER,
+    N_TASK_KINDS,
+};
+
+const char *task_kind_names[N_TASK_KINDS] = {
+    "Fetch prepare",
+    "Fetch execute",
+    "Post prepare",
+    "Post execute",
+    "Post deliver",
+};
+
+enum RequestPhase {
+    QUEUED,     // From arrival to the launch of the last attempt.
+    PREPARING,  // Until the dispatcher sees the prepare task finish.
+    HANDOFF,    // Until the execute task is launched.
+    EXECUTING,  // Until the dispatcher sees the execute task finish.
+    TOTAL,
+    N_REQUEST_PHASES,
+};
+
+const char *request_phase_names[N_REQUEST_PHASES] = {
+    "queued", "prepare", "handoff", "execute", "total",
+};
+
+// How the dispatcher issued the launches of a batch.
+enum BatchLaunchKind {
+    UNTRACED_LAUNCH,
+    FIRST_TRACED_LAUNCH,     // The first time that its trace ran.
+    REPEATED_TRACED_LAUNCH,  // A replay of its trace.
+    N_BATCH_LAUNCH_KINDS,
+};
+
+const char *batch_launch_kind_names[N_BATCH_LAUNCH_KINDS] = {
+    "Untraced",
+    "First traced",
+    "Repeated traced",
+};
+
+constexpr unsigned int N_ACTIONS = 2;
+
+const char *action_names[N_ACTIONS] = {
+    "Post",
+    "Fetch",
+};
+
+/* Statistics collected by tasks.
+ *
+ * Every thread running tasks owns one shard, so tasks on different processors
+ * never write to the same cache line. Shards are only read after all tasks have
+ * finished, when they are merged for the report. */
+struct alignas(64) TaskStats {
+    LatencyHistogram latency[N_TASK_KINDS];
+    unsigned long long fetch_message_count = 0;
+    // Unread messages that fetches skipped because they were overwritten.
+    unsigned long long fetch_expired_count = 0;
+    // Inbox entries that deliveries appended.
+    unsigned long long delivered_count = 0;
+
+    void merge(const TaskStats &other) {
+        for (unsigned int i = 0; i < N_TASK_KINDS; i++) {
+            latency[i].merge(other.latency[i]);
+        }
+        fetch_message_count += other.fetch_message_count;
+        fetch_expired_count += other.fetch_expired_count;
+        delivered_count += other.delivered_count;
+    }
+};
+
+std::mutex task_stats_mutex;
+std::vector<std::unique_ptr<TaskStats>> task_stats_shards;
+
+// Return the shard of the calling thread, creating it on first use.
+TaskStats &local_task_stats() {
+    thread_local TaskStats *stats = nullptr;
+    if (stats == nullptr) {
+        std::lock_guard<std::mutex> lock(task_stats_mutex);
+        task_stats_shards.emplace_back(new TaskStats());
+        stats = task_stats_shards.back().get();
+    }
+    return *stats;
+}
+
+// Combine the shards of all threads into out.
+void merge_task_stats(TaskStats &out) {
+    std::lock_guard<std::mutex> lock(task_stats_mutex);
+    for (auto &shard : task_stats_shards) {
+        out.merge(*shard);
+    }
+}
+
+// Clear all shards, while no tasks are running.
+void reset_task_stats() {
+    std::lock_guard<std::mutex> lock(task_stats_mutex);
+    for (auto &shard : task_stats_shards) {
+        *shard = TaskStats();
+    }
+}
+
+enum ConflictPolicy {
+    DROP,    // Report requests that failed validation.
+    RETRY,   // Prepare failed requests again, up to a bound.
+    ASSIGN,  // Let posts take the next message ID; retry failed fetches.
+};
+
+enum PostMode {
+    CHECKED_POSTS,  // Prepare the message ID and check it when executing.
+    APPEND_POSTS,   // Number posts in the dispatcher and append them at once.
+};
+
+enum DeliveryMode {
+    PULL_DELIVERY,  // Fetches read the messages of each watched channel.
+    PUSH_DELIVERY,  // Posts put references in the inboxes of followers.
+};
+
+enum Placement {
+    DEFAULT_PLACEMENT,  // Leave task placement to the default mapper.
+    OWNER_PLACEMENT,    // Run tasks on the owner of their user or channel.
+};
+
+bool parse_placement(const char *name, Placement &placement) {
+    if (strcmp(name, "default") == 0) {
+        placement = DEFAULT_PLACEMENT;
+    } else if (strcmp(name, "owner") == 0) {
+        placement = OWNER_PLACEMENT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Default launches that a dispatcher keeps outstanding at once.
+constexpr unsigned int DEFAULT_WINDOW = 64;
+
+/* Options that the mappers use as well. They are set up before the top-level
+ * task runs, so both parse the arguments with the same options and apply
+ * these with parse_mapper_option, and cannot disagree. */
+struct MapperOptions {
+    Placement placement = DEFAULT_PLACEMENT;
+};
+
+// Apply an option if it is one of the mappers'. Returns false for an invalid
+// value.
+bool parse_mapper_option(int opt, const char *arg,
+                         MapperOptions &mapper_options) {
+    switch (opt) {
+    case 'a':
+        return parse_placement(arg, mapper_options.placement);
+    default:
+        return true;
+    }
+}
+
+enum FetchMode {
+    SPLIT_FETCHES,  // Prepare and check the unread ranges in separate tasks.
+    FUSED_FETCHES,  // Read them and the messages in one task.
+};
+
+struct DispatchOptions {
+    MessageRing ring;
+    unsigned int batch_size;
+    ConflictPolicy conflict_policy;
+    unsigned int max_retries;
+    PostMode post_mode;
+    FetchMode fetch_mode;
+    DeliveryMode delivery;
+    // Messages that a fetch returns across its channels.
+    unsigned int fetch_budget;
+    // Whether to trace the launches of each batch.
+    bool tracing;
+    // Whether to answer fetches that have nothing new without a task.
+    bool fetch_cache;
+    // Whether to complete requests in launch order, as control replicated
+    // dispatchers must all make the same launches.
+    bool ordered;
+    // Dispatchers that split the requests. Each gives its posts every this
+    // many timestamps, so that they stay distinct.
+    unsigned int n_dispatchers;
+    // Most launches, of single requests or batches, that each dispatcher
+    // keeps outstanding.
+    unsigned int window;
+};
+
+struct MessagingRegions {
+    Legion::LogicalRegion users;
+    Legion::LogicalRegion follows;
+    // Next unread message of each follow, colored by user ID.
+    Legion::LogicalRegion next_unreads;
+    Legion::LogicalPartition next_unread_partition;
+    Legion::LogicalRegion channels;
+    Legion::LogicalPartition channel_partition;
+    Legion::LogicalRegion messages;
+    Legion::LogicalPartition message_partition;
+    Legion::LogicalPartition channel_message_partition;
+    Legion::LogicalRegion texts;
+    Legion::LogicalPartition text_partition;
+    // Inbox heads and entries of each user, colored by user ID, with push
+    // delivery.
+    Legion::LogicalRegion inbox_heads;
+    Legion::LogicalPartition inbox_head_partition;
+    Legion::LogicalRegion inboxes;
+    Legion::LogicalPartition inbox_partition;
+};
+
+/* Channels that each user follows, in CSR form: the users region holds the
+ * range of each user's entries in the follows region, which holds the
+ * followed channel IDs, and per-follow state such as next_unreads is indexed
+ * the same way. The copy also lists the followers of each channel, which push
+ * delivery sends posts to. */
+class FollowGraph {
+public:
+    FollowGraph() = default;
+
+    // Copy the graph out of the regions, which are only mapped meanwhile.
+    FollowGraph(Legion::LogicalRegion users, Legion::LogicalRegion follows,
+                Legion::Context ctx, Legion::Runtime *runtime) {
+        Legion::RegionRequirement user_req(users, READ_ONLY, EXCLUSIVE, users);
+        user_req.add_field(FOLLOWED_RANGE);
+        Legion::PhysicalRegion user_region =
+            runtime->map_region(ctx, Legion::InlineLauncher(user_req));
+        const Legion::FieldAccessor<READ_ONLY, Legion::Rect<1>, 1> ranges(
+            user_region, FOLLOWED_RANGE);
+        Legion::Rect<1> user_range =
+            runtime->get_index_space_domain(users.get_index_space());
+        for (Legion::PointInRectIterator<1> iter(user_range); iter(); iter++) {
+            first_follows.push_back(ranges[*iter].lo[0]);
+        }
+        runtime->unmap_region(ctx, user_region);
+
+        Legion::RegionRequirement follow_req(follows, READ_ONLY, EXCLUSIVE,
+                                             follows);
+        follow_req.add_field(FOLLOWED_CHANNEL_ID);
+        Legion::PhysicalRegion follow_region =
+            runtime->map_region(ctx, Legion::InlineLauncher(follow_req));
+        const Legion::FieldAccessor<READ_ONLY, channel_id_t, 1> followed(
+            follow_region, FOLLOWED_CHANNEL_ID);
+        Legion::Rect<1> follow_range =
+            runtime->get_index_space_domain(follows.get_index_space());
+        for (Legion::PointInRectIterator<1> iter(follow_range); iter();
+             iter++) {
+            channel_ids.push_back(followed[*iter]);
+        }
+        runtime->unmap_region(ctx, follow_region);
+        first_follows.push_back(channel_ids.size());
+        list_followers();
+    }
+
+    follow_id_t first_follow(user_id_t user_id) const {
+        return first_follows[user_id];
+    }
+
+    unsigned int follow_count(user_id_t user_id) const {
+        return first_follows[user_id + 1] - first_follows[user_id];
+    }
+
+    channel_id_t channel_id(user_id_t user_id, unsigned int i) const {
+        return channel_ids[first_follow(user_id) + i];
+    }
+
+    // Users that follow the channel, by increasing ID.
+    const std::vector<user_id_t> &followers(channel_id_t channel_id) const {
+        static const std::vector<user_id_t> none;
+        return channel_id < channel_followers.size()
+                   ? channel_followers[channel_id]
+                   : none;
+    }
+
+    // The followers of each channel are listed again from the rest.
+    size_t legion_buffer_size() const {
+        return serialized_size(first_follows) + serialized_size(channel_ids);
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, first_follows);
+        serialize_value(ptr, channel_ids);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, first_follows);
+        deserialize_value(ptr, channel_ids);
+        list_followers();
+        return ptr - (const char *)buffer;
+    }
+
+private:
+    // First follow of each user, and then the number of follows.
+    std::vector<follow_id_t> first_follows;
+    std::vector<channel_id_t> channel_ids;
+    // Followers of each channel up to the last followed one.
+    std::vector<std::vector<user_id_t>> channel_followers;
+
+    void list_followers() {
+        channel_followers.clear();
+        for (size_t user_id = 0; user_id + 1 < first_follows.size();
+             user_id++) {
+            for (follow_id_t i = first_follows[user_id];
+                 i < first_follows[user_id + 1]; i++) {
+                if (channel_ids[i] >= channel_followers.size()) {
+                    channel_followers.resize(channel_ids[i] + 1);
+                }
+                channel_followers[channel_ids[i]].push_back(user_id);
+            }
+        }
+    }
+};
+
+// Arguments of the tasks that build the follow graph.
+struct FollowGraphArgs {
+    unsigned int max_follows;
+    double follow_skew;
+    channel_id_t channel_count;
+    double popularity_skew;
+    // Users only follow channels whose ID is the same as theirs modulo this,
+    // so that each dispatcher's users and channels only touch each other.
+    unsigned int n_partitions;
+};
+
+// Arguments of a low-water update, which only covers the channels of its
+// dispatcher.
+struct LowWaterArgs {
+    unsigned int index;
+    unsigned int n_dispatchers;
+};
+
+// Weights of a Zipf distribution over n ranks, (rank + 1)^-skew. Lower IDs
+// rank higher, so a skew of 0 weighs all of them the same.
+std::vector<double> zipf_weights(size_t n, double skew) {
+    std::vector<double> weights(n);
+    for (size_t i = 0; i < n; i++) {
+        weights[i] = std::pow(i + 1, -skew);
+    }
+    return weights;
+}
+
+// Zipf exponents of the generated requests, where 0 is uniform.
+struct RequestSkew {
+    // Of the users that post.
+    double poster_skew;
+    // Of the followed channels that a user posts to, by channel ID.
+    double channel_skew;
+};
+
+/* Source of the benchmark's requests, with a given number of fetches and posts
+ * in random order. With a nonzero rate, requests arrive as a Poisson process
+ * with that many requests per second; otherwise they all arrive at once. */
+class RequestGenerator {
+public:
+    RequestGenerator(user_id_t user_count, unsigned long n_fetch_requests,
+                     unsigned long n_post_requests, double rate,
+                     RequestSkew skew, const FollowGraph &followed,
+                     std::default_random_engine rng,
+                     TraceRecorder *recorder = nullptr)
+        : user_count(user_count),
+          n_fetch_requests(n_fetch_requests),
+          n_post_requests(n_post_requests),
+          rate(rate),
+          skew(skew),
+          followed(followed),
+          rng(rng),
+          recorder(recorder) {}
+
+    // Push all requests to their queues when they arrive, then close them. A
+    // full queue holds the producer back, but not the arrival times.
+    void run(RequestRouter &queues) {
+        std::uniform_int_distribution random_user_id(user_id_t(0),
+                                                     user_id_t(user_count - 1));
+        std::vector<double> poster_weights =
+            zipf_weights(user_count, skew.poster_skew);
+        std::discrete_distribution<unsigned int> random_poster_id(
+            poster_weights.begin(), poster_weights.end());
+        // Gaps between arrivals, only defined for a nonzero rate.
+        std::exponential_distribution<double> random_gap(rate > 0 ? rate
+                                                                  : 1);
+        auto start = std::chrono::high_resolution_clock::now();
+        auto arrival = start;
+        unsigned long n_fetches = n_fetch_requests, n_posts = n_post_requests;
+        while (n_fetches + n_posts != 0) {
+            // Drawing each kind with its remaining share shuffles them.
+            Request request = {.user_id = random_user_id(rng),
+                               .attempt = 0,
+                               .text = nullptr};
+            if (std::uniform_int_distribution(1UL, n_fetches + n_posts)(rng) <=
+                n_fetches) {
+                request.action = FETCH;
+                n_fetches--;
+            } else {
+                request.action = POST;
+                if (skew.poster_skew != 0) {
+                    request.user_id = random_poster_id(rng);
+                }
+                request.channel_id = followed.channel_id(
+                    request.user_id, random_watched_ix(request.user_id));
+                n_posts--;
+            }
+            if (rate > 0) {
+                arrival += std::chrono::duration_cast<
+                    std::chrono::high_resolution_clock::duration>(
+                    std::chrono::duration<double>(random_gap(rng)));
+                std::this_thread::sleep_until(arrival);
+            } else {
+                arrival = std::chrono::high_resolution_clock::now();
+            }
+            request.arrival = arrival;
+            if (recorder != nullptr) {
+                recorder->add(request,
+                              rate > 0 ? std::chrono::duration_cast<
+                                             std::chrono::nanoseconds>(
+                                             arrival - start)
+                                             .count()
+                                       : 0);
+            }
+            while (!queues.try_push(request)) {
+                std::this_thread::yield();
+            }
+        }
+        queues.close();
+    }
+
+private:
+    user_id_t user_count;
+    unsigned long n_fetch_requests;
+    unsigned long n_post_requests;
+    double rate;
+    RequestSkew skew;
+    const FollowGraph &followed;
+    std::default_random_engine rng;
+    TraceRecorder *recorder;
+
+    // Choose which of the user's follows to post to.
+    unsigned int random_watched_ix(user_id_t user_id) {
+        unsigned int n_follows = followed.follow_count(user_id);
+        if (skew.channel_skew == 0) {
+            return std::uniform_int_distribution(0U, n_follows - 1)(rng);
+        }
+        std::vector<double> weights(n_follows);
+        for (unsigned int i = 0; i < n_follows; i++) {
+            weights[i] = std::pow(followed.channel_id(user_id, i) + 1,
+                                  -skew.channel_skew);
+        }
+        return std::discrete_distribution<unsigned int>(weights.begin(),
+                                                        weights.end())(rng);
+    }
+};
+
+/* Dispatcher state that the messaging state depends on, carried from one
+ * dispatcher to the next when the state is kept. */
+struct DispatchCursors {
+    // Timestamp of the next message.
+    time_t time = 0;
+    // Next message ID of each channel, for appended posts.
+    std::unordered_map<channel_id_t, message_id_t> next_post_ids;
+    // Write position of each channel's text arena, counting all bytes ever
+    // placed in it.
+    std::unordered_map<channel_id_t, uint64_t> next_text_bytes;
+
+    size_t legion_buffer_size() const {
+        return sizeof time + serialized_size(next_post_ids) +
+               serialized_size(next_text_bytes);
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, time);
+        serialize_value(ptr, next_post_ids);
+        serialize_value(ptr, next_text_bytes);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, time);
+        deserialize_value(ptr, next_post_ids);
+        deserialize_value(ptr, next_text_bytes);
+        return ptr - (const char *)buffer;
+    }
+};
+
+// Cursors past those of all the dispatchers, which only ever advance them.
+DispatchCursors merge_cursors(const std::vector<DispatchCursors> &all) {
+    DispatchCursors merged;
+    for (const DispatchCursors &cursors : all) {
+        merged.time = std::max(merged.time, cursors.time);
+        for (auto &[channel_id, id] : cursors.next_post_ids) {
+            merged.next_post_ids[channel_id] =
+                std::max(merged.next_post_ids[channel_id], id);
+        }
+        for (auto &[channel_id, bytes] : cursors.next_text_bytes) {
+            merged.next_text_bytes[channel_id] =
+                std::max(merged.next_text_bytes[channel_id], bytes);
+        }
+    }
+    return merged;
+}
+
+constexpr char CHECKPOINT_MAGIC[8] = {'M', 'S', 'G', 'S', 'T', 'A', 'T', 'E'};
+constexpr uint32_t CHECKPOINT_VERSION = 3;
+
+/* Header of a checkpoint, followed by the text write position of each
+ * channel. The regions are in files named <path>.<slot>.<region>. */
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot;
+    user_id_t user_count;
+    channel_id_t channel_count;
+    message_id_t msg_count;
+    follow_id_t follow_count;
+    // Slots of each inbox, or 0 without push delivery.
+    uint32_t inbox_capacity;
+    uint64_t time;
+};
+
+// A region that checkpoints hold, with its fields.
+struct SavedRegion {
+    const char *name;
+    Legion::LogicalRegion region;
+    std::vector<Legion::FieldID> fields;
+};
+
+std::string checkpoint_file(const char *path, uint32_t slot,
+                            const char *name) {
+    return std::string(path) + "." + std::to_string(slot) + "." + name;
+}
+
+/* Copy a region to or from a file, which is attached to a region of its own
+ * for the copy. The returned detach completes after the copy. */
+Legion::Future copy_file(const SavedRegion &saved, const std::string &file,
+                         bool save, Legion::Context ctx,
+                         Legion::Runtime *runtime) {
+    Legion::LogicalRegion image = runtime->create_logical_region(
+        ctx, saved.region.get_index_space(), saved.region.get_field_space());
+    Legion::AttachLauncher attach(LEGION_EXTERNAL_POSIX_FILE, image, image);
+    attach.attach_file(file.c_str(), saved.fields,
+                       save ? LEGION_FILE_CREATE : LEGION_FILE_READ_ONLY);
+    // Replicated dispatchers all name the same file.
+    attach.deduplicate_across_shards = true;
+    Legion::PhysicalRegion attached =
+        runtime->attach_external_resource(ctx, attach);
+    Legion::LogicalRegion src = save ? saved.region : image;
+    Legion::LogicalRegion dst = save ? image : saved.region;
+    Legion::CopyLauncher copy;
+    copy.add_copy_requirements(
+        Legion::RegionRequirement(src, READ_ONLY, EXCLUSIVE, src),
+        Legion::RegionRequirement(dst, WRITE_DISCARD, EXCLUSIVE, dst));
+    for (Legion::FieldID field : saved.fields) {
+        copy.add_src_field(0, field);
+        copy.add_dst_field(0, field);
+    }
+    runtime->issue_copy_operation(ctx, copy);
+    Legion::Future detached =
+        runtime->detach_external_resource(ctx, attached, save);
+    runtime->destroy_logical_region(ctx, image);
+    return detached;
+}
+
+// Replace the checkpoint header at path, through a temporary file so that
+// it always names a complete checkpoint.
+void write_checkpoint_header(const char *path, const CheckpointHeader &header,
+                             const std::vector<uint64_t> &text_bytes) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL || fwrite(&header, sizeof header, 1, file) != 1 ||
+        fwrite(text_bytes.data(), sizeof(uint64_t), text_bytes.size(),
+               file) != text_bytes.size() ||
+        fclose(file) != 0 || rename(tmp_path.c_str(), path) != 0) {
+        std::cerr << "Cannot write checkpoint " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void read_checkpoint_header(const char *path, CheckpointHeader &header,
+                            std::vector<uint64_t> &text_bytes) {
+    FILE *file = fopen(path, "rb");
+    bool valid = file != NULL && fread(&header, sizeof header, 1, file) == 1 &&
+                 memcmp(header.magic, CHECKPOINT_MAGIC,
+                        sizeof header.magic) == 0 &&
+                 header.version == CHECKPOINT_VERSION;
+    if (valid) {
+        text_bytes.resize(header.channel_count + 1);
+        valid = fread(text_bytes.data(), sizeof(uint64_t), text_bytes.size(),
+                      file) == text_bytes.size() &&
+                fgetc(file) == EOF;
+    }
+    if (file == NULL || fclose(file) != 0 || !valid) {
+        std::cerr << "Invalid checkpoint " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Checkpoints of the messaging state, taken every so many launches while
+ * requests keep being processed.
+ *
+ * Each checkpoint copies the regions as of its launch into files, and tasks
+ * only wait for it if they overwrite what it has not copied yet. Unordered
+ * dispatchers skip a checkpoint while the last one is being written, and
+ * ordered ones wait for it, as they cannot look at whether it is done.
+ * Checkpoints alternate between two slots of files, and the header only
+ * names a slot once all its files are written, so a crash while writing one
+ * leaves the one before. */
+class Checkpointer {
+public:
+    Checkpointer(const char *path, unsigned long interval,
+                 const std::vector<SavedRegion> &regions,
+                 const CheckpointHeader &header, bool ordered,
+                 bool writes_header, Legion::Context ctx,
+                 Legion::Runtime *runtime)
+        : path(path),
+          interval(interval),
+          regions(regions),
+          header(header),
+          ordered(ordered),
+          writes_header(writes_header),
+          ctx(ctx),
+          runtime(runtime) {}
+
+    // Count a launch, and tell whether to start a checkpoint after it, as
+    // one is due after every interval of them.
+    bool due() {
+        if (interval == 0 || ++n_launches < interval || !written(ordered)) {
+            return false;
+        }
+        n_launches = 0;
+        return true;
+    }
+
+    // Start a checkpoint of the state as of the launches made so far.
+    void start(const DispatchCursors &cursors) {
+        header.slot = 1 - header.slot;
+        header.time = cursors.time;
+        text_bytes.assign(header.channel_count + 1, 0);
+        for (auto &[channel_id, cursor] : cursors.next_text_bytes) {
+            text_bytes[channel_id] = cursor;
+        }
+        for (const SavedRegion &saved : regions) {
+            writes.push_back(copy_file(
+                saved, checkpoint_file(path, header.slot, saved.name), true,
+                ctx, runtime));
+        }
+    }
+
+    // Take a checkpoint and wait until it is written.
+    void save(const DispatchCursors &cursors) {
+        written(true);
+        start(cursors);
+        written(true);
+    }
+
+private:
+    const char *path;
+    unsigned long interval;
+    std::vector<SavedRegion> regions;
+    // Header of the checkpoint being written, or of the last one.
+    CheckpointHeader header;
+    std::vector<uint64_t> text_bytes;
+    bool ordered;
+    bool writes_header;
+    Legion::Context ctx;
+    Legion::Runtime *runtime;
+    unsigned long n_launches = 0;
+    std::vector<Legion::Future> writes;
+
+    // Whether the last checkpoint has been written, after waiting for it if
+    // asked to. Once it has, the header names it.
+    bool written(bool wait) {
+        if (writes.empty()) {
+            return true;
+        }
+        for (Legion::Future &write : writes) {
+            if (wait) {
+                write.get_void_result();
+            } else if (!write.is_ready()) {
+                return false;
+            }
+        }
+        writes.clear();
+        if (writes_header) {
+            write_checkpoint_header(path, header, text_bytes);
+        }
+        return true;
+    }
+};
+
+// Counts and latencies of the requests of a dispatcher.
+struct DispatchStats {
+    unsigned long n_failed_fetch = 0;
+    unsigned long n_failed_post = 0;
+    unsigned long n_attempts = 0;
+    unsigned long n_retries = 0;
+    unsigned long n_cache_hits = 0;
+    // Time each request spent in each phase, by action.
+    LatencyHistogram request_latency[N_ACTIONS][N_REQUEST_PHASES];
+    // Time to issue the launches of each batch.
+    LatencyHistogram batch_launch_latency[N_BATCH_LAUNCH_KINDS];
+
+    void merge(const DispatchStats &other) {
+        n_failed_fetch += other.n_failed_fetch;
+        n_failed_post += other.n_failed_post;
+        n_attempts += other.n_attempts;
+        n_retries += other.n_retries;
+        n_cache_hits += other.n_cache_hits;
+        for (unsigned int i = 0; i < N_ACTIONS; i++) {
+            for (unsigned int j = 0; j < N_REQUEST_PHASES; j++) {
+                request_latency[i][j].merge(other.request_latency[i][j]);
+            }
+        }
+        for (unsigned int i = 0; i < N_BATCH_LAUNCH_KINDS; i++) {
+            batch_launch_latency[i].merge(other.batch_launch_latency[i]);
+        }
+    }
+};
+
+/* Moves requests through their prepare and execute tasks.
+ *
+ * Requests wait in pending_* while their prepare task runs and in executing_*
+ * while their execute task runs, keyed by the pending ID that the tasks report
+ * back through the completion queues of the dispatcher's index. */
+class Dispatcher : public DispatchStats {
+public:
+    Dispatcher(const DispatchOptions &options, const MessagingRegions &regions,
+               const FollowGraph &followed, RequestQueue &arrivals,
+               const DispatchCursors &cursors, Checkpointer *checkpointer,
+               Legion::Context ctx, Legion::Runtime *runtime,
+               unsigned int index = 0)
+        : options(options),
+          regions(regions),
+          followed(followed),
+          arrivals(arrivals),
+          checkpointer(checkpointer),
+          ctx(ctx),
+          runtime(runtime),
+          index(index),
+          next_pending_id(index),
+          time(cursors.time + index),
+          next_post_ids(cursors.next_post_ids),
+          next_text_bytes(cursors.next_text_bytes) {}
+
+    DispatchCursors cursors() const {
+        return {.time = time,
+                .next_post_ids = next_post_ids,
+                .next_text_bytes = next_text_bytes};
+    }
+
+    /* Process requests until all of them, and their deliveries, have
+     * completed, keeping up to options.window launches outstanding. A full
+     * window waits for a task instead of launching, and leaves later requests
+     * in the arrival queue, which holds the producer back. Launches are
+     * forgotten as they complete, so memory stays bounded however long the
+     * run. */
+    void run() {
+        if (options.ordered) {
+            run_ordered();
+            return;
+        }
+        while (requests.size() != 0 || !arrivals.drained() || !idle()) {
+            bool progress = false;
+            prepared_reqs[index].drain(ready_ids);
+            for (pending_id_t id : ready_ids) {
+                on_prepared(id);
+                progress = true;
+            }
+            executed_reqs[index].drain(ready_ids);
+            for (pending_id_t id : ready_ids) {
+                on_executed(id);
+                progress = true;
+            }
+
+            take_arrivals(false);
+
+            bool full = n_outstanding() >= options.window;
+            if (requests.size() == 0 || full) {
+                // Nothing can be launched until a task finishes or, unless
+                // the window is full, a request arrives.
+                if (!progress) {
+                    doorbells[index].wait();
+                }
+                continue;
+            }
+            launch_next();
+        }
+        drain();
+    }
+
+    // Process requests, keeping up to options.window launches outstanding and
+    // completing the oldest one whenever the window is full. Every decision
+    // only depends on task results, so all shards of a replicated dispatcher
+    // make the same ones.
+    void run_ordered() {
+        while (requests.size() != 0 || !arrivals.drained() || !idle()) {
+            // Tasks on this node still queue their IDs.
+            prepared_reqs[index].drain(ready_ids);
+            executed_reqs[index].drain(ready_ids);
+            if (n_outstanding() < options.window) {
+                take_arrivals(true);
+                if (requests.size() != 0) {
+                    launch_next();
+                    continue;
+                }
+            }
+            if (!idle()) {
+                complete_oldest();
+            }
+        }
+        drain();
+    }
+
+private:
+    const DispatchOptions options;
+    const MessagingRegions regions;
+    const FollowGraph &followed;
+    RequestQueue &arrivals;
+    // Arrived and retried requests that have not been launched yet.
+    std::deque<Request> requests;
+    Checkpointer *checkpointer;
+    Legion::Context ctx;
+    Legion::Runtime *runtime;
+    const unsigned int index;
+
+    std::unordered_map<pending_id_t, PendingRequest> pending_reqs;
+    std::unordered_map<pending_id_t, PendingRequest> executing_reqs;
+    std::unordered_map<pending_id_t, PendingBatch> pending_batches;
+    std::unordered_map<pending_id_t, PendingBatch> executing_batches;
+    std::vector<pending_id_t> ready_ids;
+    pending_id_t next_pending_id;
+    // See DispatchCursors.
+    time_t time;
+    std::unordered_map<channel_id_t, message_id_t> next_post_ids;
+    std::unordered_map<channel_id_t, uint64_t> next_text_bytes;
+    Legion::Future low_water_update;
+    // Traces that have run at least once.
+    std::unordered_set<Legion::TraceID> traced_shapes;
+    // Number of successful posts to each channel, and the sum of them over
+    // its channels when each user last read all their messages. As versions
+    // only grow, an equal sum means that none of the channels changed.
+    std::unordered_map<channel_id_t, uint64_t> channel_versions;
+    std::unordered_map<user_id_t, uint64_t> caught_up_versions;
+    // Inbox entries of completed posts that have not been delivered yet, by
+    // follower, in order so that replicated dispatchers launch the same.
+    std::map<user_id_t, std::vector<InboxEntry>> deliveries;
+    // Delivery launches that may still be running, oldest first.
+    std::deque<Legion::FutureMap> delivery_launches;
+
+    // Pending IDs of this dispatcher, see MAX_DISPATCHERS.
+    pending_id_t new_pending_id() {
+        pending_id_t id = next_pending_id;
+        next_pending_id += MAX_DISPATCHERS;
+        return id;
+    }
+
+    bool idle() const {
+        return pending_reqs.size() == 0 && executing_reqs.size() == 0 &&
+               pending_batches.size() == 0 && executing_batches.size() == 0;
+    }
+
+    size_t n_outstanding() const {
+        return pending_reqs.size() + executing_reqs.size() +
+               pending_batches.size() + executing_batches.size();
+    }
+
+    // Move arrived requests to the back of requests until they make up a
+    // batch, leaving the others queued. Waiting takes a whole batch, or all
+    // that are left, so that the launches do not depend on arrival times.
+    void take_arrivals(bool wait) {
+        Request request;
+        while (requests.size() < options.batch_size) {
+            if (arrivals.try_pop(request)) {
+                requests.push_back(request);
+            } else if (!wait || arrivals.drained()) {
+                return;
+            } else {
+                doorbells[index].wait();
+            }
+        }
+    }
+
+    void launch_next() {
+        if (options.batch_size > 1) {
+            launch_batch();
+        } else {
+            launch(requests.front());
+            requests.pop_front();
+            time += options.n_dispatchers;
+        }
+        if (checkpointer != nullptr && checkpointer->due()) {
+            checkpointer->start(cursors());
+        }
+    }
+
+    // Wait for the current task of the earliest launched request or batch,
+    // then move it on like a queued ID would.
+    void complete_oldest() {
+        pending_id_t id = std::numeric_limits<pending_id_t>::max();
+        for (auto *reqs : {&pending_reqs, &executing_reqs}) {
+            for (auto &entry : *reqs) {
+                id = std::min(id, entry.first);
+            }
+        }
+        for (auto *batches : {&pending_batches, &executing_batches}) {
+            for (auto &entry : *batches) {
+                id = std::min(id, entry.first);
+            }
+        }
+        auto req_it = pending_reqs.find(id);
+        if (req_it != pending_reqs.end()) {
+            req_it->second.future.get_void_result();
+            on_prepared(id);
+            return;
+        }
+        req_it = executing_reqs.find(id);
+        if (req_it != executing_reqs.end()) {
+            req_it->second.future.get_void_result();
+            on_executed(id);
+            return;
+        }
+        // Count the whole batch as its last point to finish.
+        auto batch_it = pending_batches.find(id);
+        if (batch_it != pending_batches.end()) {
+            batch_it->second.futures.wait_all_results();
+            batch_it->second.n_running = 1;
+            on_prepared(id);
+            return;
+        }
+        batch_it = executing_batches.find(id);
+        batch_it->second.futures.wait_all_results();
+        batch_it->second.n_running = 1;
+        on_executed(id);
+    }
+
+    std::vector<channel_id_t> watched_channel_ids(user_id_t user_id) {
+        std::vector<channel_id_t> channel_ids(followed.follow_count(user_id));
+        for (unsigned int i = 0; i < channel_ids.size(); i++) {
+            channel_ids[i] = followed.channel_id(user_id, i);
+        }
+        return channel_ids;
+    }
+
+    // Wait for the tasks that no request waits for, so that they are done,
+    // and their stats complete, by the time run returns.
+    void drain() {
+        for (Legion::FutureMap &launch : delivery_launches) {
+            launch.wait_all_results();
+        }
+        delivery_launches.clear();
+        if (low_water_update.exists()) {
+            low_water_update.get_void_result();
+        }
+    }
+
+    // Recompute the low-water marks of this dispatcher's channels, unless an
+    // update is still running. Later posts see the result. Ordered
+    // dispatchers cannot look at whether it is running, so they wait for it.
+    void update_low_water() {
+        if (low_water_update.exists()) {
+            if (options.ordered) {
+                low_water_update.get_void_result();
+            } else if (!low_water_update.is_ready()) {
+                return;
+            }
+        }
+        LowWaterArgs args = {.index = index,
+                             .n_dispatchers = options.n_dispatchers};
+        Legion::TaskLauncher launcher(LOW_WATER_TASK,
+                                      Legion::TaskArgument(&args, sizeof args));
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.follows, READ_ONLY, EXCLUSIVE, regions.follows));
+        launcher.add_field(0, FOLLOWED_CHANNEL_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.next_unreads, READ_ONLY, EXCLUSIVE, regions.next_unreads));
+        launcher.add_field(1, NEXT_UNREAD_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.channels, READ_ONLY, EXCLUSIVE, regions.channels));
+        launcher.add_field(2, NEXT_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.channels, READ_WRITE, EXCLUSIVE, regions.channels));
+        launcher.add_field(3, LOW_WATER_MSG_ID);
+        low_water_update = runtime->execute_task(ctx, launcher);
+    }
+
+    // Decide what happens to a request whose execute task has finished.
+    void complete(Request &request, bool success, bool full = false) {
+        if (full) {
+            update_low_water();
+        }
+        if (success) {
+            finish(request);
+            return;
+        }
+        if (options.conflict_policy != DROP &&
+            request.attempt < options.max_retries) {
+            request.attempt++;
+            n_retries++;
+            requests.push_front(request);
+            return;
+        }
+        finish(request);
+        if (request.action == FETCH) {
+            n_failed_fetch++;
+        } else {
+            n_failed_post++;
+        }
+    }
+
+    void finish(const Request &request) {
+        auto now = std::chrono::high_resolution_clock::now();
+        std::chrono::high_resolution_clock::time_point stamps[] = {
+            request.arrival, request.launched, request.prepared,
+            request.executing, now};
+        LatencyHistogram *latency = request_latency[request.action];
+        for (unsigned int i = 0; i < TOTAL; i++) {
+            latency[i].record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    stamps[i + 1] - stamps[i])
+                    .count());
+        }
+        latency[TOTAL].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - request.arrival)
+                .count());
+    }
+
+    /* Finish a fetch without launching it if its user has read all messages
+     * of its channels at their current versions. Otherwise note the versions
+     * that the fetch will see, for when it completes. Every decision follows
+     * task results, so replicated dispatchers all take the same ones. */
+    bool answered_from_cache(Request &request) {
+        if (!options.fetch_cache || request.action != FETCH) {
+            return false;
+        }
+        request.channel_versions = 0;
+        for (unsigned int i = 0; i < followed.follow_count(request.user_id);
+             i++) {
+            request.channel_versions +=
+                channel_versions[followed.channel_id(request.user_id, i)];
+        }
+        auto it = caught_up_versions.find(request.user_id);
+        if (it == caught_up_versions.end() ||
+            it->second != request.channel_versions) {
+            return false;
+        }
+        n_cache_hits++;
+        finish(request);
+        return true;
+    }
+
+    // Time the launch of an attempt. Requests that skip their prepare task
+    // keep these as their prepare and execute times.
+    static void stamp_launch(Request &request) {
+        request.launched = std::chrono::high_resolution_clock::now();
+        request.prepared = request.launched;
+        request.executing = request.launched;
+    }
+
+    bool skips_prepare(const Request &request) {
+        if (request.action == FETCH) {
+            return options.fetch_mode == FUSED_FETCHES ||
+                   options.delivery == PUSH_DELIVERY;
+        }
+        return options.conflict_policy == ASSIGN ||
+               options.post_mode == APPEND_POSTS;
+    }
+
+    PrepareFetchData prepare_fetch_data(const Request &request,
+                                        pending_id_t id) {
+        return {.pending_id = id,
+                .user_id = request.user_id,
+                .first_follow = followed.first_follow(request.user_id),
+                .watched_channel_ids = watched_channel_ids(request.user_id)};
+    }
+
+    // Data for a fused fetch, or for an execute task if given the results of
+    // the prepare task.
+    ExecuteFetchData execute_fetch_data(
+        const Request &request, pending_id_t id,
+        PrepareFetchResponse *response = nullptr) {
+        ExecuteFetchData data = {
+            .pending_id = id,
+            .user_id = request.user_id,
+            .first_follow = followed.first_follow(request.user_id),
+            .ring = options.ring,
+            .budget = options.fetch_budget,
+            .watched_channel_ids = watched_channel_ids(request.user_id)};
+        if (response != nullptr) {
+            data.next_unread_msg_ids = std::move(response->next_unread_msg_ids);
+            data.next_channel_msg_ids =
+                std::move(response->next_channel_msg_ids);
+        }
+        return data;
+    }
+
+    // Posts without a prepared message ID take the next one of the channel.
+    ExecutePostData execute_post_data(Request &request,
+                                      const PreparePostResponse *response,
+                                      pending_id_t id) {
+        message_id_t msg_id = response ? response->next_channel_msg_id : 0;
+        Message msg = {
+            .message_id = msg_id,
+            .author_id = request.user_id,
+            .timestamp = time,
+        };
+        time += options.n_dispatchers;
+        if (request.text != nullptr) {
+            memcpy(msg.text, request.text, request.text_length);
+            msg.text[request.text_length] = '\0';
+        } else {
+            snprintf(msg.text, MESSAGE_LENGTH, msg_template, request.user_id,
+                     request.channel_id);
+        }
+        ExecutePostData data = {.pending_id = id,
+                                .ring = options.ring,
+                                .channel_id = request.channel_id,
+                                .assign_id = response == nullptr,
+                                .next_channel_msg_id = msg_id,
+                                .text_offset = 0,
+                                .message = msg};
+        size_t length = msg.text.length();
+        if (length > INLINE_TEXT_LENGTH) {
+            data.text_offset =
+                options.ring.place_text(next_text_bytes[request.channel_id],
+                                        TextRef::entry_size(length));
+        }
+        return data;
+    }
+
+    // Data for a post that skipped its prepare task.
+    ExecutePostData unprepared_post_data(Request &request, pending_id_t id) {
+        if (options.post_mode == APPEND_POSTS) {
+            // All posts to the channel go through this dispatcher, so it can
+            // number them.
+            PreparePostResponse response = {
+                .next_channel_msg_id = next_post_ids[request.channel_id]++};
+            return execute_post_data(request, &response, id);
+        }
+        return execute_post_data(request, nullptr, id);
+    }
+
+    // Start the first task of a single request.
+    void launch(Request &request) {
+        stamp_launch(request);
+        if (answered_from_cache(request)) {
+            return;
+        }
+        pending_id_t id = new_pending_id();
+        if (skips_prepare(request) && request.action == FETCH) {
+            executing_reqs[id] = {.future = fused_fetch(request, id),
+                                  .request = request};
+            n_attempts++;
+            return;
+        }
+        if (skips_prepare(request)) {
+            ExecutePostData data = unprepared_post_data(request, id);
+            executing_reqs[id] = {.future = execute_post(data),
+                                  .request = request};
+            n_attempts++;
+            return;
+        }
+        switch (request.action) {
         case FETCH: {
-            PrepareFetchData data = {.user_id = request.user_id};
-            PerUserChannel<channel_id_t> watched_channel_ids =
-                channel_id_mem[request.user_id];
-            memcpy(data.watched_channel_ids, watched_channel_ids,
-                   sizeof data.watched_channel_ids);
+            PrepareFetchData data = prepare_fetch_data(request, id);
+            std::vector<char> args = serialized(data);
             Legion::TaskLauncher launcher(
                 PREPARE_FETCH_TASK,
-                Legion::TaskArgument(&data, sizeof(PrepareFetchData)));
+                Legion::TaskArgument(args.data(), args.size()));
+            launcher.point = Legion::DomainPoint(request.user_id);
             launcher.add_region_requirement(Legion::RegionRequirement(
-                runtime->get_logical_subregion_by_color(next_unread_partition,
-                                                        request.user_id),
-                READ_ONLY, EXCLUSIVE, next_unreads));
-            launcher.add_field(0, NEXT_UNREAD_MSG_IDS);
-            for (unsigned int i = 0; i < CHANNELS_PER_USER; i++) {
+                runtime->get_logical_subregion_by_color(
+                    regions.next_unread_partition, request.user_id),
+                READ_ONLY, EXCLUSIVE, regions.next_unreads));
+            launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+            for (unsigned int i = 0; i < data.watched_channel_ids.size();
+                 i++) {
                 launcher.add_region_requirement(Legion::RegionRequirement(
                     runtime->get_logical_subregion_by_color(
-                        channel_partition, watched_channel_ids[i]),
-                    READ_ONLY, EXCLUSIVE, channels));
+                        regions.channel_partition, data.watched_channel_ids[i]),
+                    READ_ONLY, EXCLUSIVE, regions.channels));
                 launcher.add_field(1 + i, NEXT_MSG_ID);
             }
-            pending_reqs.push_back(
-                {.future = runtime->execute_task(ctx, launcher),
-                 .request = request});
-            break;
+            pending_reqs[id] = {.future = runtime->execute_task(ctx, launcher),
+                                .request = request};
+            break;
+        }
+
+        case POST: {
+            PreparePostData data = {.pending_id = id,
+                                    .channel_id = request.channel_id};
+            Legion::TaskLauncher launcher(
+                PREPARE_POST_TASK,
+                Legion::TaskArgument(&data, sizeof(PreparePostData)));
+            launcher.point = Legion::DomainPoint(request.channel_id);
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(
+                    regions.channel_partition, request.channel_id),
+                READ_ONLY, EXCLUSIVE, regions.channels));
+            launcher.add_field(0, NEXT_MSG_ID);
+            pending_reqs[id] = {.future = runtime->execute_task(ctx, launcher),
+                                .request = request};
+            break;
+        }
+        }
+    }
+
+    Legion::Future execute_fetch(ExecuteFetchData &data) {
+        std::vector<char> args = serialized(data);
+        Legion::TaskLauncher launcher(
+            EXECUTE_FETCH_TASK, Legion::TaskArgument(args.data(), args.size()));
+        launcher.point = Legion::DomainPoint(data.user_id);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(
+                regions.next_unread_partition, data.user_id),
+            READ_WRITE, EXCLUSIVE, regions.next_unreads));
+        launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+        // For each channel with returned messages, one requirement for its
+        // text arena and one for each run of the messages in a block. The
+        // task walks the messages in the same order to find their regions.
+        unsigned long reqid = 1;
+        std::vector<message_id_t> firsts, lasts;
+        data.ranges(firsts, lasts);
+        for (unsigned int i = 0; i < firsts.size(); i++) {
+            message_id_t first = firsts[i], last = lasts[i];
+            if (first != last) {
+                launcher.add_region_requirement(Legion::RegionRequirement(
+                    runtime->get_logical_subregion_by_color(
+                        regions.text_partition, data.watched_channel_ids[i]),
+                    READ_ONLY, EXCLUSIVE, regions.texts));
+                launcher.add_field(reqid, TEXT_BYTE);
+                reqid++;
+            }
+            for (message_id_t j = first; j < last; j++) {
+                message_id_t block = data.ring.block(j);
+                if (j != first && block == data.ring.block(j - 1)) {
+                    continue;
+                }
+                launcher.add_region_requirement(Legion::RegionRequirement(
+                    runtime->get_logical_subregion_by_color(
+                        regions.message_partition,
+                        Legion::Point<2>(data.watched_channel_ids[i], block)),
+                    READ_ONLY, EXCLUSIVE, regions.messages));
+                launcher.add_field(reqid, AUTHOR_ID);
+                launcher.add_field(reqid, TIMESTAMP);
+                launcher.add_field(reqid, TEXT);
+                reqid++;
+            }
+        }
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    // Add requirements for all messages of each channel, and then its text
+    // arena, from first_reqid on.
+    void add_channel_rows(Legion::TaskLauncher &launcher,
+                          const std::vector<channel_id_t> &channel_ids,
+                          unsigned int first_reqid) {
+        for (unsigned int i = 0; i < channel_ids.size(); i++) {
+            unsigned int reqid = first_reqid + 2 * i;
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(
+                    regions.channel_message_partition, channel_ids[i]),
+                READ_ONLY, EXCLUSIVE, regions.messages));
+            launcher.add_field(reqid, AUTHOR_ID);
+            launcher.add_field(reqid, TIMESTAMP);
+            launcher.add_field(reqid, TEXT);
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(regions.text_partition,
+                                                        channel_ids[i]),
+                READ_ONLY, EXCLUSIVE, regions.texts));
+            launcher.add_field(reqid + 1, TEXT_BYTE);
+        }
+    }
+
+    // The unread ranges are only known once the task runs, so it reads all
+    // messages of the watched channels.
+    Legion::Future fused_fetch(const Request &request, pending_id_t id) {
+        if (options.delivery == PUSH_DELIVERY) {
+            return inbox_fetch(request, id);
+        }
+        ExecuteFetchData data = execute_fetch_data(request, id);
+        std::vector<char> args = serialized(data);
+        Legion::TaskLauncher launcher(
+            FUSED_FETCH_TASK, Legion::TaskArgument(args.data(), args.size()));
+        launcher.point = Legion::DomainPoint(data.user_id);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(
+                regions.next_unread_partition, data.user_id),
+            READ_WRITE, EXCLUSIVE, regions.next_unreads));
+        launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+        unsigned int n_channels = data.watched_channel_ids.size();
+        for (unsigned int i = 0; i < n_channels; i++) {
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(
+                    regions.channel_partition, data.watched_channel_ids[i]),
+                READ_ONLY, EXCLUSIVE, regions.channels));
+            launcher.add_field(1 + i, NEXT_MSG_ID);
+        }
+        add_channel_rows(launcher, data.watched_channel_ids, 1 + n_channels);
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    // Fetches of pushed messages read the user's inbox, and the messages
+    // that it refers to in the rows of the watched channels.
+    Legion::Future inbox_fetch(const Request &request, pending_id_t id) {
+        ExecuteFetchData data = execute_fetch_data(request, id);
+        std::vector<char> args = serialized(data);
+        Legion::TaskLauncher launcher(
+            INBOX_FETCH_TASK, Legion::TaskArgument(args.data(), args.size()));
+        launcher.point = Legion::DomainPoint(data.user_id);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(
+                regions.next_unread_partition, data.user_id),
+            READ_WRITE, EXCLUSIVE, regions.next_unreads));
+        launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(
+                regions.inbox_head_partition, data.user_id),
+            READ_WRITE, EXCLUSIVE, regions.inbox_heads));
+        launcher.add_field(1, INBOX_END);
+        launcher.add_field(1, INBOX_NEXT_UNREAD);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(regions.inbox_partition,
+                                                    data.user_id),
+            READ_ONLY, EXCLUSIVE, regions.inboxes));
+        launcher.add_field(2, INBOX_ENTRY);
+        add_channel_rows(launcher, data.watched_channel_ids, 3);
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    Legion::FutureMap fused_fetch_batch(PendingBatch &batch, pending_id_t id) {
+        if (options.delivery == PUSH_DELIVERY) {
+            return inbox_fetch_batch(batch, id);
+        }
+        Legion::ArgumentMap arg_map;
+        for (Request &request : batch.requests) {
+            std::vector<char> args =
+                serialized(execute_fetch_data(request, id));
+            arg_map.set_point(batch_point(request),
+                              Legion::TaskArgument(args.data(), args.size()));
+        }
+        Legion::IndexTaskLauncher launcher(FUSED_FETCH_BATCH_TASK,
+                                           batch.launch_space,
+                                           Legion::TaskArgument(), arg_map);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.next_unread_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.next_unreads));
+        launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.channels, 0, READ_ONLY, EXCLUSIVE, regions.channels));
+        launcher.add_field(1, NEXT_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.messages, 0, READ_ONLY, EXCLUSIVE, regions.messages));
+        launcher.add_field(2, AUTHOR_ID);
+        launcher.add_field(2, TIMESTAMP);
+        launcher.add_field(2, TEXT);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.texts, 0, READ_ONLY, EXCLUSIVE, regions.texts));
+        launcher.add_field(3, TEXT_BYTE);
+        return runtime->execute_index_space(ctx, launcher);
+    }
+
+    Legion::FutureMap inbox_fetch_batch(PendingBatch &batch, pending_id_t id) {
+        Legion::ArgumentMap arg_map;
+        for (Request &request : batch.requests) {
+            std::vector<char> args =
+                serialized(execute_fetch_data(request, id));
+            arg_map.set_point(batch_point(request),
+                              Legion::TaskArgument(args.data(), args.size()));
+        }
+        Legion::IndexTaskLauncher launcher(INBOX_FETCH_TASK, batch.launch_space,
+                                           Legion::TaskArgument(), arg_map);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.next_unread_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.next_unreads));
+        launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.inbox_head_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.inbox_heads));
+        launcher.add_field(1, INBOX_END);
+        launcher.add_field(1, INBOX_NEXT_UNREAD);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.inbox_partition, 0, READ_ONLY, EXCLUSIVE,
+            regions.inboxes));
+        launcher.add_field(2, INBOX_ENTRY);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.messages, 0, READ_ONLY, EXCLUSIVE, regions.messages));
+        launcher.add_field(3, AUTHOR_ID);
+        launcher.add_field(3, TIMESTAMP);
+        launcher.add_field(3, TEXT);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.texts, 0, READ_ONLY, EXCLUSIVE, regions.texts));
+        launcher.add_field(4, TEXT_BYTE);
+        return runtime->execute_index_space(ctx, launcher);
+    }
+
+    /* Append the entries of the posts completed so far to the inboxes of
+     * their followers, in one launch over the followers. Fetches launched
+     * after it see them. */
+    void deliver() {
+        if (deliveries.empty()) {
+            return;
+        }
+        Legion::ArgumentMap arg_map;
+        std::vector<Legion::DomainPoint> points;
+        for (auto &[user_id, entries] : deliveries) {
+            DeliverData data = {.entries = std::move(entries)};
+            std::vector<char> args = serialized(data);
+            points.push_back(Legion::DomainPoint(user_id));
+            arg_map.set_point(points.back(),
+                              Legion::TaskArgument(args.data(), args.size()));
+        }
+        deliveries.clear();
+        Legion::IndexSpace launch_space =
+            runtime->create_index_space(ctx, points);
+        Legion::IndexTaskLauncher launcher(DELIVER_TASK, launch_space,
+                                           Legion::TaskArgument(), arg_map);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.inbox_head_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.inbox_heads));
+        launcher.add_field(0, INBOX_END);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.inbox_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.inboxes));
+        launcher.add_field(1, INBOX_ENTRY);
+        // Keep as many deliveries outstanding as the window allows launches.
+        if (delivery_launches.size() >= options.window) {
+            delivery_launches.front().wait_all_results();
+            delivery_launches.pop_front();
+        }
+        delivery_launches.push_back(
+            runtime->execute_index_space(ctx, launcher));
+        runtime->destroy_index_space(ctx, launch_space);
+    }
+
+    Legion::Future execute_post(ExecutePostData &data) {
+        if (options.post_mode == APPEND_POSTS) {
+            return append_post(data);
+        }
+        std::vector<char> args = serialized(data);
+        Legion::TaskLauncher launcher(
+            EXECUTE_POST_TASK, Legion::TaskArgument(args.data(), args.size()));
+        launcher.point = Legion::DomainPoint(data.channel_id);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(regions.channel_partition,
+                                                    data.channel_id),
+            READ_WRITE, EXCLUSIVE, regions.channels));
+        launcher.add_field(0, NEXT_MSG_ID);
+        launcher.add_field(0, LOW_WATER_MSG_ID);
+        if (data.assign_id) {
+            // The message ID is only known once the task runs.
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(
+                    regions.channel_message_partition, data.channel_id),
+                READ_WRITE, EXCLUSIVE, regions.messages));
+        } else {
+            // Other messages in the block must be preserved.
+            message_id_t block_size = data.ring.block_size;
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                runtime->get_logical_subregion_by_color(
+                    regions.message_partition,
+                    Legion::Point<2>(
+                        data.channel_id,
+                        data.ring.block(data.next_channel_msg_id))),
+                block_size == 1 ? WRITE_DISCARD : READ_WRITE, EXCLUSIVE,
+                regions.messages));
+        }
+        launcher.add_field(1, AUTHOR_ID);
+        launcher.add_field(1, TIMESTAMP);
+        launcher.add_field(1, TEXT);
+        add_text_requirement(launcher, data, EXCLUSIVE);
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    // Posts with a text that is not inlined also write the channel's arena.
+    void add_text_requirement(Legion::TaskLauncher &launcher,
+                              const ExecutePostData &data,
+                              CoherenceProperty coherence) {
+        if (data.message.text.length() <= INLINE_TEXT_LENGTH) {
+            return;
+        }
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(regions.text_partition,
+                                                    data.channel_id),
+            READ_WRITE, coherence, regions.texts));
+        launcher.add_field(2, TEXT_BYTE);
+    }
+
+    // Concurrent appends to a channel only reduce its counter and write
+    // distinct messages, so none of them has to wait for another.
+    Legion::Future append_post(ExecutePostData &data) {
+        std::vector<char> args = serialized(data);
+        Legion::TaskLauncher launcher(
+            APPEND_POST_TASK, Legion::TaskArgument(args.data(), args.size()));
+        launcher.point = Legion::DomainPoint(data.channel_id);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(regions.channel_partition,
+                                                    data.channel_id),
+            MAX_MESSAGE_ID_REDOP, EXCLUSIVE, regions.channels));
+        launcher.add_field(0, NEXT_MSG_ID);
+        message_id_t block_size = data.ring.block_size;
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            runtime->get_logical_subregion_by_color(
+                regions.message_partition,
+                Legion::Point<2>(data.channel_id,
+                                 data.ring.block(data.next_channel_msg_id))),
+            block_size == 1 ? WRITE_DISCARD : READ_WRITE,
+            block_size == 1 ? EXCLUSIVE : SIMULTANEOUS, regions.messages));
+        launcher.add_field(1, AUTHOR_ID);
+        launcher.add_field(1, TIMESTAMP);
+        launcher.add_field(1, TEXT);
+        // Appended texts take distinct arena bytes too.
+        add_text_requirement(launcher, data, SIMULTANEOUS);
+        return runtime->execute_task(ctx, launcher);
+    }
+
+    // Take requests off the front until the batch is full or a key repeats,
+    // since points of an index launch must not interfere.
+    void launch_batch() {
+        PendingBatch fetches = {.action = FETCH}, posts = {.action = POST};
+        std::unordered_set<user_id_t> fetch_users;
+        std::unordered_set<channel_id_t> post_channels;
+        while (requests.size() != 0 &&
+               fetches.requests.size() + posts.requests.size() <
+                   options.batch_size) {
+            Request &request = requests.front();
+            stamp_launch(request);
+            if (answered_from_cache(request)) {
+                requests.pop_front();
+                time += options.n_dispatchers;
+                continue;
+            }
+            if (request.action == FETCH) {
+                if (!fetch_users.insert(request.user_id).second) {
+                    break;
+                }
+                fetches.requests.push_back(request);
+            } else {
+                if (!post_channels.insert(request.channel_id).second) {
+                    break;
+                }
+                posts.requests.push_back(request);
+            }
+            requests.pop_front();
+            time += options.n_dispatchers;
+        }
+        if (fetches.requests.size() + posts.requests.size() == 0) {
+            return;
+        }
+        for (PendingBatch *batch : {&fetches, &posts}) {
+            std::vector<Legion::DomainPoint> points;
+            for (const Request &request : batch->requests) {
+                points.push_back(batch_point(request));
+            }
+            if (points.size() != 0) {
+                batch->launch_space = runtime->create_index_space(ctx, points);
+                batch->n_running = points.size();
+            }
+        }
+        /* With tracing, all batches skip their prepare tasks, so each call
+         * issues one index launch for each action with requests. Only the
+         * points of the launches differ, so they repeat with one of three
+         * shapes, each traced under its own ID. The traces are logical only,
+         * memoizing the dependence analysis, since physical templates would
+         * not match the changing launch domains. */
+        Legion::TraceID trace_id = (fetches.requests.size() != 0) +
+                                   2 * (posts.requests.size() != 0);
+        auto issue = std::chrono::high_resolution_clock::now();
+        if (options.tracing) {
+            runtime->begin_trace(ctx, trace_id, true);
+        }
+        for (PendingBatch *batch : {&fetches, &posts}) {
+            if (batch->requests.size() == 0) {
+                continue;
+            }
+            pending_id_t id = new_pending_id();
+            if (skips_prepare(batch->requests.front())) {
+                batch->futures = execute_batch(*batch, id);
+                n_attempts += batch->requests.size();
+                executing_batches[id] = std::move(*batch);
+                continue;
+            }
+            Legion::ArgumentMap arg_map;
+            for (const Request &request : batch->requests) {
+                if (batch->action == FETCH) {
+                    std::vector<char> args =
+                        serialized(prepare_fetch_data(request, id));
+                    arg_map.set_point(
+                        batch_point(request),
+                        Legion::TaskArgument(args.data(), args.size()));
+                } else {
+                    PreparePostData data = {.pending_id = id,
+                                            .channel_id = request.channel_id};
+                    arg_map.set_point(batch_point(request),
+                                      Legion::TaskArgument(&data, sizeof data));
+                }
+            }
+            if (batch->action == FETCH) {
+                // The whole channels region stands in for the watched
+                // channels, which differ from point to point.
+                Legion::IndexTaskLauncher launcher(
+                    PREPARE_FETCH_TASK, batch->launch_space,
+                    Legion::TaskArgument(), arg_map);
+                launcher.add_region_requirement(Legion::RegionRequirement(
+                    regions.next_unread_partition, 0, READ_ONLY, EXCLUSIVE,
+                    regions.next_unreads));
+                launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+                launcher.add_region_requirement(
+                    Legion::RegionRequirement(regions.channels, 0, READ_ONLY,
+                                              EXCLUSIVE, regions.channels));
+                launcher.add_field(1, NEXT_MSG_ID);
+                batch->futures = runtime->execute_index_space(ctx, launcher);
+            } else {
+                Legion::IndexTaskLauncher launcher(
+                    PREPARE_POST_TASK, batch->launch_space,
+                    Legion::TaskArgument(), arg_map);
+                launcher.add_region_requirement(Legion::RegionRequirement(
+                    regions.channel_partition, 0, READ_ONLY, EXCLUSIVE,
+                    regions.channels));
+                launcher.add_field(0, NEXT_MSG_ID);
+                batch->futures = runtime->execute_index_space(ctx, launcher);
+            }
+            pending_batches[id] = std::move(*batch);
+        }
+        BatchLaunchKind kind = UNTRACED_LAUNCH;
+        if (options.tracing) {
+            runtime->end_trace(ctx, trace_id);
+            kind = traced_shapes.insert(trace_id).second
+                       ? FIRST_TRACED_LAUNCH
+                       : REPEATED_TRACED_LAUNCH;
+        }
+        batch_launch_latency[kind].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - issue)
+                .count());
+    }
+
+    // Launch the execute tasks of a batch, using the results of its prepare
+    // tasks unless it skipped them.
+    Legion::FutureMap execute_batch(PendingBatch &batch, pending_id_t id) {
+        bool prepared = !skips_prepare(batch.requests.front());
+        if (batch.action == FETCH && !prepared) {
+            return fused_fetch_batch(batch, id);
+        }
+        Legion::ArgumentMap arg_map;
+        for (Request &request : batch.requests) {
+            Legion::DomainPoint point = batch_point(request);
+            if (batch.action == FETCH) {
+                PrepareFetchResponse response =
+                    batch.futures.get_result<PrepareFetchResponse>(point);
+                std::vector<char> args =
+                    serialized(execute_fetch_data(request, id, &response));
+                arg_map.set_point(
+                    point, Legion::TaskArgument(args.data(), args.size()));
+            } else {
+                ExecutePostData data;
+                if (prepared) {
+                    PreparePostResponse response =
+                        batch.futures.get_result<PreparePostResponse>(point);
+                    data = execute_post_data(request, &response, id);
+                } else {
+                    data = unprepared_post_data(request, id);
+                }
+                std::vector<char> args = serialized(data);
+                arg_map.set_point(
+                    point, Legion::TaskArgument(args.data(), args.size()));
+            }
+        }
+        if (batch.action == FETCH) {
+            Legion::IndexTaskLauncher launcher(EXECUTE_FETCH_BATCH_TASK,
+                                               batch.launch_space,
+                                               Legion::TaskArgument(), arg_map);
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                regions.next_unread_partition, 0, READ_WRITE, EXCLUSIVE,
+                regions.next_unreads));
+            launcher.add_field(0, NEXT_UNREAD_MSG_ID);
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                regions.messages, 0, READ_ONLY, EXCLUSIVE, regions.messages));
+            launcher.add_field(1, AUTHOR_ID);
+            launcher.add_field(1, TIMESTAMP);
+            launcher.add_field(1, TEXT);
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                regions.texts, 0, READ_ONLY, EXCLUSIVE, regions.texts));
+            launcher.add_field(2, TEXT_BYTE);
+            return runtime->execute_index_space(ctx, launcher);
+        }
+        bool append = options.post_mode == APPEND_POSTS;
+        Legion::IndexTaskLauncher launcher(
+            append ? APPEND_POST_TASK : EXECUTE_POST_TASK, batch.launch_space,
+            Legion::TaskArgument(), arg_map);
+        if (append) {
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                regions.channel_partition, 0, MAX_MESSAGE_ID_REDOP, EXCLUSIVE,
+                regions.channels));
+            launcher.add_field(0, NEXT_MSG_ID);
+        } else {
+            launcher.add_region_requirement(Legion::RegionRequirement(
+                regions.channel_partition, 0, READ_WRITE, EXCLUSIVE,
+                regions.channels));
+            launcher.add_field(0, NEXT_MSG_ID);
+            launcher.add_field(0, LOW_WATER_MSG_ID);
+        }
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.channel_message_partition, 0, READ_WRITE, EXCLUSIVE,
+            regions.messages));
+        launcher.add_field(1, AUTHOR_ID);
+        launcher.add_field(1, TIMESTAMP);
+        launcher.add_field(1, TEXT);
+        launcher.add_region_requirement(Legion::RegionRequirement(
+            regions.text_partition, 0, READ_WRITE,
+            append ? SIMULTANEOUS : EXCLUSIVE, regions.texts));
+        launcher.add_field(2, TEXT_BYTE);
+        return runtime->execute_index_space(ctx, launcher);
+    }
+
+    void on_prepared(pending_id_t id) {
+        auto batch_it = pending_batches.find(id);
+        if (batch_it != pending_batches.end()) {
+            PendingBatch &batch = batch_it->second;
+            if (--batch.n_running != 0) {
+                return;
+            }
+            auto prepared = std::chrono::high_resolution_clock::now();
+            for (Request &request : batch.requests) {
+                request.prepared = prepared;
+            }
+            batch.futures = execute_batch(batch, id);
+            auto executing = std::chrono::high_resolution_clock::now();
+            for (Request &request : batch.requests) {
+                request.executing = executing;
+            }
+            batch.n_running = batch.requests.size();
+            n_attempts += batch.requests.size();
+            executing_batches[id] = std::move(batch);
+            pending_batches.erase(batch_it);
+            return;
+        }
+
+        auto it = pending_reqs.find(id);
+        PendingRequest &req = it->second;
+        req.request.prepared = std::chrono::high_resolution_clock::now();
+        Legion::Future future;
+        switch (req.request.action) {
+        case FETCH: {
+            PrepareFetchResponse response =
+                req.future.get_result<PrepareFetchResponse>();
+            ExecuteFetchData data =
+                execute_fetch_data(req.request, id, &response);
+            future = execute_fetch(data);
+            break;
+        }
+        case POST: {
+            PreparePostResponse response =
+                req.future.get_result<PreparePostResponse>();
+            ExecutePostData data =
+                execute_post_data(req.request, &response, id);
+            future = execute_post(data);
+            break;
+        }
+        }
+        req.request.executing = std::chrono::high_resolution_clock::now();
+        executing_reqs[id] = {.future = future, .request = req.request};
+        n_attempts++;
+        pending_reqs.erase(it);
+    }
+
+    void complete(Request &request, const Legion::Future &future) {
+        switch (request.action) {
+        case FETCH:
+            complete_fetch(request, future.get_result<ExecuteFetchResponse>());
+            return;
+        case POST:
+            complete_post(request, future.get_result<ExecutePostResponse>());
+            return;
+        }
+    }
+
+    void complete(Request &request, const Legion::FutureMap &futures,
+                  const Legion::DomainPoint &point) {
+        switch (request.action) {
+        case FETCH:
+            complete_fetch(request,
+                           futures.get_result<ExecuteFetchResponse>(point));
+            return;
+        case POST:
+            complete_post(request,
+                          futures.get_result<ExecutePostResponse>(point));
+            return;
+        }
+    }
+
+    // A caught up fetch read all messages that had been posted when it was
+    // launched.
+    void complete_fetch(Request &request,
+                        const ExecuteFetchResponse &response) {
+        if (options.fetch_cache && response.success && response.caught_up) {
+            caught_up_versions[request.user_id] = request.channel_versions;
+        }
+        complete(request, response.success);
+    }
+
+    void complete_post(Request &request, const ExecutePostResponse &response) {
+        if (response.success) {
+            channel_versions[request.channel_id]++;
+        }
+        if (response.success && options.delivery == PUSH_DELIVERY) {
+            for (user_id_t user_id : followed.followers(request.channel_id)) {
+                deliveries[user_id].push_back(
+                    {.channel_id = request.channel_id,
+                     .message_id = response.message_id,
+                     .timestamp = response.timestamp});
+            }
+        }
+        complete(request, response.success, response.full);
+    }
+
+    void on_executed(pending_id_t id) {
+        auto batch_it = executing_batches.find(id);
+        if (batch_it != executing_batches.end()) {
+            PendingBatch &batch = batch_it->second;
+            if (--batch.n_running != 0) {
+                return;
+            }
+            for (Request &request : batch.requests) {
+                complete(request, batch.futures, batch_point(request));
+            }
+            deliver();
+            runtime->destroy_index_space(ctx, batch.launch_space);
+            executing_batches.erase(batch_it);
+            return;
+        }
+
+        auto it = executing_reqs.find(id);
+        PendingRequest &req = it->second;
+        complete(req.request, req.future);
+        deliver();
+        executing_reqs.erase(it);
+    }
+};
+
+// Requests of one benchmark configuration.
+struct Workload {
+    unsigned long n_requests;
+    unsigned long request_ratio;
+    unsigned long n_fetch_requests;
+    unsigned long n_post_requests;
+};
+
+// Outcome of one run of a workload.
+struct RunResult {
+    double seconds;
+    unsigned long n_failed_fetch;
+    unsigned long n_failed_post;
+    unsigned long n_attempts;
+    unsigned long n_retries;
+    unsigned long n_cache_hits;
+};
+
+// Mean and sample standard deviation of the values.
+void mean_stddev(const std::vector<double> &values, double &mean,
+                 double &stddev) {
+    mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    double squares = 0;
+    for (double value : values) {
+        squares += (value - mean) * (value - mean);
+    }
+    stddev = values.size() > 1 ? std::sqrt(squares / (values.size() - 1)) : 0;
+}
+
+/* Results of all runs of a workload, with the latencies of all of them.
+ *
+ * The text report reads like that of a single run, with times averaged over
+ * the runs and counts summed. */
+struct WorkloadResults {
+    Workload workload;
+    std::vector<RunResult> runs;
+    LatencyHistogram request_latency[N_ACTIONS][N_REQUEST_PHASES];
+    LatencyHistogram batch_launch_latency[N_BATCH_LAUNCH_KINDS];
+    TaskStats task_stats;
+
+    void add(const RunResult &run, const DispatchStats &stats) {
+        runs.push_back(run);
+        for (unsigned int i = 0; i < N_ACTIONS; i++) {
+            for (unsigned int j = 0; j < N_REQUEST_PHASES; j++) {
+                request_latency[i][j].merge(stats.request_latency[i][j]);
+            }
+        }
+        for (unsigned int i = 0; i < N_BATCH_LAUNCH_KINDS; i++) {
+            batch_launch_latency[i].merge(stats.batch_launch_latency[i]);
+        }
+    }
+
+    RunResult totals() const {
+        RunResult total = {};
+        for (const RunResult &run : runs) {
+            total.seconds += run.seconds;
+            total.n_failed_fetch += run.n_failed_fetch;
+            total.n_failed_post += run.n_failed_post;
+            total.n_attempts += run.n_attempts;
+            total.n_retries += run.n_retries;
+            total.n_cache_hits += run.n_cache_hits;
+        }
+        return total;
+    }
+
+    // Requests per second that eventually succeeded, in each run.
+    std::vector<double> goodputs() const {
+        std::vector<double> values;
+        for (const RunResult &run : runs) {
+            values.push_back((workload.n_fetch_requests +
+                              workload.n_post_requests - run.n_failed_fetch -
+                              run.n_failed_post) /
+                             run.seconds);
+        }
+        return values;
+    }
+
+    void print(std::ostream &out) const {
+        RunResult total = totals();
+        unsigned long n_runs = runs.size();
+        const LatencyHistogram *latency = task_stats.latency;
+        double fetch_time =
+            latency[FETCH_PREPARE].total() + latency[FETCH_EXECUTE].total();
+        double post_time =
+            latency[POST_PREPARE].total() + latency[POST_EXECUTE].total();
+
+        out << std::fixed << std::setprecision(0);
+        out << "Time: " << total.seconds * 1e9 / n_runs << " ns" << std::endl;
+        out << "Fetch: " << fetch_time / latency[FETCH_EXECUTE].count()
+            << " ns average, " << total.n_failed_fetch << "/"
+            << workload.n_fetch_requests * n_runs << " failed, "
+            << task_stats.fetch_message_count << " messages, "
+            << task_stats.fetch_expired_count << " expired, "
+            << total.n_cache_hits << " answered from cache" << std::endl;
+        out << "Post: " << post_time / latency[POST_EXECUTE].count()
+            << " ns average, " << total.n_failed_post << "/"
+            << workload.n_post_requests * n_runs << " failed" << std::endl;
+        const LatencyHistogram &deliveries = latency[POST_DELIVER];
+        if (deliveries.count() != 0) {
+            out << "Deliver: " << deliveries.total() / deliveries.count()
+                << " ns average, " << task_stats.delivered_count
+                << " inbox entries" << std::endl;
+        }
+        // Goodput only counts requests that eventually succeeded.
+        unsigned long n_succeeded =
+            (workload.n_fetch_requests + workload.n_post_requests) * n_runs -
+            total.n_failed_fetch - total.n_failed_post;
+        out << "Throughput: " << n_succeeded / total.seconds
+            << " requests/s goodput, " << total.n_attempts / total.seconds
+            << " attempts/s raw, " << total.n_retries << " retries"
+            << std::endl;
+        double batch_launch_means[N_BATCH_LAUNCH_KINDS];
+        for (unsigned int i = 0; i < N_BATCH_LAUNCH_KINDS; i++) {
+            const LatencyHistogram &launches = batch_launch_latency[i];
+            batch_launch_means[i] =
+                launches.count() == 0 ? 0 : launches.total() / launches.count();
+            if (launches.count() != 0) {
+                out << batch_launch_kind_names[i]
+                    << " batch issue time: " << batch_launch_means[i]
+                    << " ns average, p99 " << launches.quantile(0.99)
+                    << " ns, " << launches.count() << " batches" << std::endl;
+            }
+        }
+        // This is the time that the dispatcher takes to issue the launches,
+        // not the time that the runtime spends analyzing them.
+        if (batch_launch_means[REPEATED_TRACED_LAUNCH] != 0) {
+            out << "Trace issue speedup: " << std::setprecision(2)
+                << batch_launch_means[FIRST_TRACED_LAUNCH] /
+                       batch_launch_means[REPEATED_TRACED_LAUNCH]
+                << "x" << std::setprecision(0) << std::endl;
+        }
+        for (unsigned int action : {FETCH, POST}) {
+            for (unsigned int i = 0; i < N_REQUEST_PHASES; i++) {
+                const LatencyHistogram &phase = request_latency[action][i];
+                out << action_names[action] << " " << request_phase_names[i]
+                    << ": p50 " << phase.quantile(0.5) << " ns, p99 "
+                    << phase.quantile(0.99) << " ns, p999 "
+                    << phase.quantile(0.999) << " ns, " << phase.count()
+                    << " requests" << std::endl;
+            }
+        }
+        for (unsigned int i = 0; i < N_TASK_KINDS; i++) {
+            out << task_kind_names[i] << ": p50 " << latency[i].quantile(0.5)
+                << " ns, p99 " << latency[i].quantile(0.99) << " ns, p999 "
+                << latency[i].quantile(0.999) << " ns, " << latency[i].count()
+                << " tasks" << std::endl;
+        }
+    }
+
+    // Write the results as a JSON object.
+    void write_json(std::ostream &out) const {
+        std::vector<double> times, attempt_rates;
+        for (const RunResult &run : runs) {
+            times.push_back(run.seconds * 1e9);
+            attempt_rates.push_back(run.n_attempts / run.seconds);
+        }
+        double mean, stddev;
+        RunResult total = totals();
+        out << std::fixed << std::setprecision(0);
+        out << "{\"requests\": " << workload.n_requests
+            << ", \"ratio\": " << workload.request_ratio
+            << ", \"fetch_requests\": " << workload.n_fetch_requests
+            << ", \"post_requests\": " << workload.n_post_requests;
+        mean_stddev(times, mean, stddev);
+        out << ", \"time_ns\": {\"mean\": " << mean
+            << ", \"stddev\": " << stddev << "}";
+        out << std::setprecision(2);
+        mean_stddev(goodputs(), mean, stddev);
+        out << ", \"goodput\": {\"mean\": " << mean
+            << ", \"stddev\": " << stddev << "}";
+        mean_stddev(attempt_rates, mean, stddev);
+        out << ", \"attempts_per_second\": {\"mean\": " << mean
+            << ", \"stddev\": " << stddev << "}";
+        out << std::setprecision(0);
+        out << ", \"failed_fetches\": " << total.n_failed_fetch
+            << ", \"failed_posts\": " << total.n_failed_post
+            << ", \"retries\": " << total.n_retries
+            << ", \"cache_hits\": " << total.n_cache_hits
+            << ", \"inbox_entries\": " << task_stats.delivered_count;
+        out << ", \"latency_ns\": {";
+        for (unsigned int action : {FETCH, POST}) {
+            const LatencyHistogram &phase = request_latency[action][TOTAL];
+            out << (action == FETCH ? "" : ", ") << "\"" << action_names[action]
+                << "\": {\"p50\": " << phase.quantile(0.5)
+                << ", \"p99\": " << phase.quantile(0.99)
+                << ", \"p999\": " << phase.quantile(0.999) << "}";
+        }
+        out << "}, \"runs\": [";
+        for (size_t i = 0; i < runs.size(); i++) {
+            out << (i == 0 ? "" : ", ")
+                << "{\"time_ns\": " << runs[i].seconds * 1e9
+                << ", \"failed_fetches\": " << runs[i].n_failed_fetch
+                << ", \"failed_posts\": " << runs[i].n_failed_post
+                << ", \"retries\": " << runs[i].n_retries
+                << ", \"cache_hits\": " << runs[i].n_cache_hits << "}";
+        }
+        out << "]}";
+    }
+};
+
+// Parse a comma-separated list of numbers, such as "1,10".
+bool parse_list(const char *text, std::vector<unsigned long> &values) {
+    values.clear();
+    char *end;
+    while (true) {
+        values.push_back(strtoul(text, &end, 10));
+        if (end == text || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        if (*end == '\0') {
+            return true;
+        }
+        text = end + 1;
+    }
+}
+
+/* Arguments of the dispatcher subtasks, which launches pass serialized
+ * through the legion_* methods. Each dispatcher gets its own copy of the
+ * graph and of the cursors to start from, and its regions as point
+ * arguments. */
+struct DispatcherArgs {
+    DispatchOptions options;
+    FollowGraph followed;
+    DispatchCursors cursors;
+
+    size_t legion_buffer_size() const {
+        return sizeof options + followed.legion_buffer_size() +
+               cursors.legion_buffer_size();
+    }
+
+    size_t legion_serialize(void *buffer) const {
+        char *ptr = (char *)buffer;
+        serialize_value(ptr, options);
+        ptr += followed.legion_serialize(ptr);
+        ptr += cursors.legion_serialize(ptr);
+        return ptr - (char *)buffer;
+    }
+
+    size_t legion_deserialize(const void *buffer) {
+        const char *ptr = (const char *)buffer;
+        deserialize_value(ptr, options);
+        ptr += followed.legion_deserialize(ptr);
+        ptr += cursors.legion_deserialize(ptr);
+        return ptr - (const char *)buffer;
+    }
+};
+
+/* Partition of a region into the part of each of n dispatchers: the union
+ * of the subregions of by_id, which is colored by user or channel ID, whose
+ * ID is the dispatcher's index modulo n. */
+Legion::LogicalPartition dispatcher_partition(
+    Legion::LogicalRegion region, Legion::LogicalPartition by_id,
+    Legion::IndexSpace dispatcher_ids, unsigned int n, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    Legion::IndexPartition ids = by_id.get_index_partition();
+    std::vector<std::vector<Legion::IndexSpace>> parts(n);
+    for (Legion::Domain::DomainPointIterator iter(
+             runtime->get_index_partition_color_space(ids));
+         iter; iter++) {
+        parts[iter.p[0] % n].push_back(
+            runtime->get_index_subspace(ids, iter.p));
+    }
+    Legion::IndexPartition pending = runtime->create_pending_partition(
+        ctx, region.get_index_space(), dispatcher_ids, DISJOINT_KIND);
+    for (unsigned int i = 0; i < n; i++) {
+        runtime->create_index_space_union(ctx, pending, Legion::Point<1>(i),
+                                          parts[i]);
+    }
+    return runtime->get_logical_partition(region, pending);
+}
+
+// Partition of part, a subregion of the region of partition, into what it
+// holds of each subregion of partition, under the same colors.
+Legion::LogicalPartition restrict_partition(Legion::LogicalRegion part,
+                                            Legion::LogicalPartition partition,
+                                            Legion::Context ctx,
+                                            Legion::Runtime *runtime) {
+    return runtime->get_logical_partition(
+        part, runtime->create_partition_by_intersection(
+                  ctx, part.get_index_space(),
+                  partition.get_index_partition(), DISJOINT_KIND));
+}
+
+// Counts and latencies of each dispatcher subtask, which are too large to
+// return through a future. Like the completion queues, they rely on the
+// subtasks sharing the address space of dispatch_task.
+DispatchStats dispatcher_stats[MAX_DISPATCHERS];
+
+/* Dispatch the requests of one queue from a task of its own, so that its
+ * launches are issued and analyzed in its context, alongside those of the
+ * other dispatchers.
+ *
+ * Nothing orders the tasks of different dispatchers, so none of them may
+ * touch data of another. Dispatcher i owns the users and channels whose ID is
+ * i modulo the number of dispatchers, and its users only follow its channels,
+ * which dispatch_task checks. Its point gets the part of the next unread IDs,
+ * inboxes, channels, messages and texts of its users and channels, and only
+ * reads the users and follows. Its regions are those parts, partitioned with
+ * the same colors as the whole regions, so its launches name the same
+ * subregions as a single dispatcher's, and batched launches, which name
+ * whole regions, name its parts. */
+DispatchCursors dispatcher_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    DispatcherArgs args;
+    args.legion_deserialize(task->args);
+    const MessagingRegions &parts = *(const MessagingRegions *)task->local_args;
+    unsigned int index = task->index_point[0];
+    Dispatcher dispatcher(args.options, parts, args.followed,
+                          *arrival_queues[index], args.cursors, nullptr, ctx,
+                          runtime, index);
+    dispatcher.run();
+    dispatcher_stats[index] = dispatcher;
+    return dispatcher.cursors();
+}
+
+void dispatch_task(const Legion::Task *task,
+                   const std::vector<Legion::PhysicalRegion> &regions,
+                   Legion::Context ctx, Legion::Runtime *runtime) {
+    const Legion::InputArgs &args = Legion::Runtime::get_input_args();
+    user_id_t user_count = 0;
+    channel_id_t channel_count = 0;
+    message_id_t msg_count = 0;
+    // Every combination of request count and ratio is one workload.
+    std::vector<unsigned long> request_counts;
+    std::vector<unsigned long> request_ratios = {1};
+    unsigned int iterations = 1;
+    message_id_t msg_block_size = 1;
+    long retention = -1;
+    unsigned int batch_size = 1;
+    ConflictPolicy conflict_policy = DROP;
+    unsigned int max_retries = 3;
+    PostMode post_mode = CHECKED_POSTS;
+    FetchMode fetch_mode = SPLIT_FETCHES;
+    DeliveryMode delivery = PULL_DELIVERY;
+    unsigned int fetch_budget = MAX_RETURNED_MESSAGES;
+    unsigned int max_follows = DEFAULT_FOLLOWS;
+    double follow_skew = 0;
+    double popularity_skew = 0;
+    RequestSkew request_skew = {.poster_skew = 0, .channel_skew = 0};
+    bool tracing = false;
+    bool fetch_cache = false;
+    unsigned int n_dispatchers = 1;
+    // Partitions of the follow graph, by default one per dispatcher.
+    unsigned int graph_partitions = 0;
+    unsigned int window = DEFAULT_WINDOW;
+    MapperOptions mapper_options;
+    double arrival_rate = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *latency_path = NULL;
+    const char *json_path = NULL;
+    const char *checkpoint_path = NULL;
+    // Launches between checkpoints, or 0 to only take one at the end.
+    unsigned long checkpoint_interval = 0;
+    const char *restore_path = NULL;
+    bool valid_policy = true;
+
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long_only(args.argc, args.argv, "", options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'n':
+            user_count = atoi(optarg);
+            break;
+        case 'k':
+            channel_count = atoi(optarg);
+            break;
+        case 'm':
+            msg_count = atoi(optarg);
+            break;
+        case 't':
+            valid_policy &= parse_list(optarg, request_counts);
+            break;
+        case 'r':
+            valid_policy &= parse_list(optarg, request_ratios);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'y':
+            json_path = optarg;
+            break;
+        case 'C':
+            checkpoint_path = optarg;
+            break;
+        case 'P':
+            checkpoint_interval = atol(optarg);
+            break;
+        case 'R':
+            restore_path = optarg;
+            break;
+        case 'b':
+            msg_block_size = atoi(optarg);
+            break;
+        case 'w':
+            retention = atol(optarg);
+            break;
+        case 'q':
+            fetch_budget = atoi(optarg);
+            break;
+        case 'd':
+            max_follows = atoi(optarg);
+            break;
+        case 's':
+            follow_skew = atof(optarg);
+            break;
+        case 'v':
+            popularity_skew = atof(optarg);
+            break;
+        case 'z':
+            request_skew.poster_skew = atof(optarg);
+            break;
+        case 'h':
+            request_skew.channel_skew = atof(optarg);
+            break;
+        case 'j':
+            tracing = true;
+            break;
+        case 'H':
+            fetch_cache = true;
+            break;
+        case 'g':
+            batch_size = atoi(optarg);
+            break;
+        case 'c':
+            if (strcmp(optarg, "drop") == 0) {
+                conflict_policy = DROP;
+            } else if (strcmp(optarg, "retry") == 0) {
+                conflict_policy = RETRY;
+            } else if (strcmp(optarg, "assign") == 0) {
+                conflict_policy = ASSIGN;
+            } else {
+                valid_policy = false;
+            }
+            break;
+        case 'x':
+            max_retries = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "checked") == 0) {
+                post_mode = CHECKED_POSTS;
+            } else if (strcmp(optarg, "append") == 0) {
+                post_mode = APPEND_POSTS;
+            } else {
+                valid_policy = false;
+            }
+            break;
+        case 'a':
+            valid_policy &= parse_mapper_option(opt, optarg, mapper_options);
+            break;
+        case 'K':
+            n_dispatchers = atoi(optarg);
+            break;
+        case 'Q':
+            graph_partitions = atoi(optarg);
+            break;
+        case 'W':
+            window = atoi(optarg);
+            break;
+        case 'u':
+            if (strcmp(optarg, "split") == 0) {
+                fetch_mode = SPLIT_FETCHES;
+            } else if (strcmp(optarg, "fused") == 0) {
+                fetch_mode = FUSED_FETCHES;
+            } else {
+                valid_policy = false;
+            }
+            break;
+        case 'D':
+            if (strcmp(optarg, "pull") == 0) {
+                delivery = PULL_DELIVERY;
+            } else if (strcmp(optarg, "push") == 0) {
+                delivery = PUSH_DELIVERY;
+            } else {
+                valid_policy = false;
+            }
+            break;
+        case 'l':
+            arrival_rate = atof(optarg);
+            break;
+        case 'o':
+            record_path = optarg;
+            break;
+        case 'f':
+            replay_path = optarg;
+            break;
+        case 'e':
+            latency_path = optarg;
+            break;
+        case '?':
+        default:
+            break;
+        }
+    }
+
+    // Check that (nonzero) arguments are given.
+    // Replayed traces bring their own requests.
+    if (user_count == 0 || channel_count == 0 || msg_count == 0 ||
+        (request_counts.empty() && replay_path == NULL) ||
+        std::count(request_counts.begin(), request_counts.end(), 0) != 0 ||
+        std::count(request_ratios.begin(), request_ratios.end(), 0) != 0 ||
+        iterations == 0 || batch_size == 0 ||
+        (record_path != NULL && replay_path != NULL) ||
+        fetch_budget == 0 ||
+        fetch_budget > ExecuteFetchResponse::MAX_MESSAGES ||
+        max_follows == 0 || follow_skew < 0 || popularity_skew < 0 ||
+        arrival_rate < 0 ||
+        request_skew.poster_skew < 0 || request_skew.channel_skew < 0 ||
+        (checkpoint_interval != 0 && checkpoint_path == NULL) ||
+        n_dispatchers == 0 || n_dispatchers > MAX_DISPATCHERS ||
+        (graph_partitions != 0 && graph_partitions % n_dispatchers != 0) ||
+        window == 0 || !valid_policy) {
+        std::cerr << "Usage: " << args.argv[0]
+                  << " [-n num_users] [-k num_channels] [-m num_messages] [-t "
+                     "test_requests,...] [-r test_request_ratio,...] [-i "
+                     "iterations] [-g "
+                     "request_batch_size] [-b message_block_size] [-c "
+                     "drop|retry|assign] [-x max_retries] [-p "
+                     "checked|append] [-u split|fused] [-D pull|push] [-q "
+                     "fetch_budget] [-d max_follows] [-s follow_skew] [-v "
+                     "popularity_skew] [-z poster_skew] [-h channel_skew] "
+                     "[-j] [-H] "
+                     "[-w retained_messages] [-a default|owner] [-K "
+                     "dispatchers [-Q graph_partitions]] [-W window] [-l "
+                     "arrivals_per_second] [-o record_trace | -f "
+                     "replay_trace] [-e latency_csv] [-y results_json] [-C "
+                     "checkpoint [-P checkpoint_interval]] [-R "
+                     "restored_checkpoint]"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Zero block size means a single block for each channel.
+    if (msg_block_size == 0 || msg_block_size > msg_count) {
+        msg_block_size = msg_count;
+    }
+
+    // By default, channels keep as many messages as they have room for.
+    if (retention < 0 || retention > msg_count) {
+        retention = msg_count;
+    }
+
+    // Appended posts cannot fail, so they cannot wait for readers.
+    if (retention == 0 && post_mode == APPEND_POSTS) {
+        std::cerr << "Appended posts need a nonzero retention" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Appends to the slots of a block run at once, so those in flight must
+    // not wrap around the ring onto each other's slots.
+    if (post_mode == APPEND_POSTS && msg_block_size > 1 &&
+        (uint64_t)window * batch_size >= msg_count) {
+        std::cerr << "Appended posts to blocks of several messages need a "
+                     "window of fewer than "
+                  << (msg_count + batch_size - 1) / batch_size
+                  << " launches" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Prepared batches launch their execute tasks as the results come in,
+    // in between other launches, so they cannot be traced.
+    if (tracing &&
+        (batch_size == 1 ||
+         (fetch_mode != FUSED_FETCHES && delivery != PUSH_DELIVERY) ||
+         (conflict_policy != ASSIGN && post_mode != APPEND_POSTS))) {
+        std::cerr << "Tracing needs batches of fused or pushed fetches and of "
+                     "assigned or appended posts"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Checkpoints are taken from the launches of a single dispatcher.
+    if (n_dispatchers > 1 && checkpoint_interval != 0) {
+        std::cerr << "Several dispatchers need no periodic checkpoints"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Each dispatcher's users and channels must only touch each other, so
+    // they make up whole partitions of the graph. Check that we have enough
+    // channels to choose from, among those of each partition.
+    if (graph_partitions == 0) {
+        graph_partitions = n_dispatchers;
+    }
+    if (channel_count / graph_partitions < max_follows) {
+        std::cerr << "You must specify at least "
+                  << max_follows * graph_partitions << " channels"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // A recorded trace holds the requests of a single run.
+    if (record_path != NULL &&
+        (request_counts.size() != 1 || request_ratios.size() != 1 ||
+         iterations != 1)) {
+        std::cerr << "Recording needs a single workload and iteration"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<Workload> workloads;
+    for (unsigned long n_requests : request_counts) {
+        for (unsigned long request_ratio : request_ratios) {
+            unsigned long n_post_requests = n_requests / (request_ratio + 1);
+            workloads.push_back({n_requests, request_ratio,
+                                 n_post_requests * request_ratio,
+                                 n_post_requests});
+        }
+    }
+    std::unique_ptr<TraceReplayer> replayer;
+    if (replay_path != NULL) {
+        replayer = std::make_unique<TraceReplayer>(replay_path);
+        const TraceHeader &header = replayer->header();
+        if (header.user_count > user_count ||
+            header.channel_count > channel_count) {
+            std::cerr << "The trace needs " << header.user_count
+                      << " users and " << (int)header.channel_count
+                      << " channels" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // Replays run the recorded requests in place of the workloads.
+        unsigned long n_requests =
+            header.n_fetch_requests + header.n_post_requests;
+        workloads = {{n_requests,
+                      header.n_post_requests == 0
+                          ? 0
+                          : header.n_fetch_requests / header.n_post_requests,
+                      header.n_fetch_requests, header.n_post_requests}};
+    }
+
+    // Check that we will have at lest one request. Sweeps skip the
+    // workloads that have none.
+    auto empty = std::remove_if(
+        workloads.begin(), workloads.end(), [](const Workload &workload) {
+            if (workload.n_post_requests == 0) {
+                std::cerr << "Skipping " << workload.n_requests
+                          << " requests at ratio " << workload.request_ratio
+                          << std::endl;
+            }
+            return workload.n_post_requests == 0;
+        });
+    workloads.erase(empty, workloads.end());
+    if (workloads.empty()) {
+        std::cerr
+            << "The number of requests is too low for the chosen ratio.\n"
+            << "Please increase the number of requests or decrease the ratio."
+            << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Inboxes hold as many references as a channel holds messages.
+    uint32_t inbox_capacity = delivery == PUSH_DELIVERY ? msg_count : 0;
+
+    // A restored checkpoint brings the follow graph and all messages.
+    CheckpointHeader restored;
+    std::vector<uint64_t> restored_text_bytes;
+    if (restore_path != NULL) {
+        read_checkpoint_header(restore_path, restored, restored_text_bytes);
+        if (restored.user_count != user_count ||
+            restored.channel_count != channel_count ||
+            restored.msg_count != msg_count) {
+            std::cerr << "The checkpoint has " << restored.user_count
+                      << " users, " << (int)restored.channel_count
+                      << " channels and " << restored.msg_count
+                      << " messages" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (restored.inbox_capacity != inbox_capacity) {
+            std::cerr << "The checkpoint has "
+                      << (restored.inbox_capacity == 0 ? "pulled" : "pushed")
+                      << " messages" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::default_random_engine rng;
+
+    /* Users array, holding the range of each user's follows. */
+    Legion::Rect<1> user_id_range(0, user_count);
+    Legion::IndexSpaceT<1> user_ids =
+        runtime->create_index_space(ctx, user_id_range);
+    Legion::IndexPartition user_id_partition =
+        runtime->create_equal_partition(ctx, user_ids, user_ids);
+    Legion::FieldSpace user_fields = runtime->create_field_space(ctx);
+    Legion::FieldAllocator allocator =
+        runtime->create_field_allocator(ctx, user_fields);
+    allocator.allocate_field(sizeof(Legion::Rect<1>), FOLLOWED_RANGE);
+    Legion::LogicalRegionT<1> users =
+        runtime->create_logical_region(ctx, user_ids, user_fields);
+    // Init tasks build the follow graph in blocks of users, one per CPU,
+    // unless it is restored.
+    size_t n_cpus =
+        Legion::Machine::ProcessorQuery(Legion::Machine::get_machine())
+            .only_kind(Legion::Processor::LOC_PROC)
+            .count();
+    Legion::IndexSpaceT<1> init_blocks = runtime->create_index_space(
+        ctx,
+        Legion::Rect<1>(0, std::min(n_cpus, user_id_range.volume()) - 1));
+    Legion::LogicalPartition user_block_partition =
+        runtime->get_logical_partition(
+            users, runtime->create_equal_partition(ctx, user_ids, init_blocks));
+    FollowGraphArgs graph_args = {.max_follows = max_follows,
+                                  .follow_skew = follow_skew,
+                                  .channel_count = channel_count,
+                                  .popularity_skew = popularity_skew,
+                                  .n_partitions = graph_partitions};
+    bool restoring = restore_path != NULL;
+    Legion::FutureMap block_follow_counts;
+    if (!restoring) {
+        Legion::IndexTaskLauncher count_launcher(
+            COUNT_FOLLOWS_TASK, init_blocks,
+            Legion::TaskArgument(&graph_args, sizeof(FollowGraphArgs)),
+            Legion::ArgumentMap());
+        count_launcher.add_region_requirement(Legion::RegionRequirement(
+            user_block_partition, 0, WRITE_DISCARD, EXCLUSIVE, users));
+        count_launcher.add_field(0, FOLLOWED_RANGE);
+        block_follow_counts = runtime->execute_index_space(ctx, count_launcher);
+    }
+
+    /* Follows array, with the channels of each user in its range. Each block
+     * of users has the next block of follows. */
+    std::map<Legion::DomainPoint, Legion::Domain> follow_blocks;
+    follow_id_t follow_count = restoring ? restored.follow_count : 0;
+    for (Legion::PointInRectIterator<1> iter(
+             runtime->get_index_space_domain(init_blocks));
+         !restoring && iter(); iter++) {
+        follow_id_t count = block_follow_counts.get_result<follow_id_t>(*iter);
+        follow_blocks[*iter] =
+            Legion::Rect<1>(follow_count, follow_count + count - 1);
+        follow_count += count;
+    }
+    Legion::Rect<1> follow_id_range(0, follow_count - 1);
+    Legion::IndexSpaceT<1> follow_ids =
+        runtime->create_index_space(ctx, follow_id_range);
+    Legion::FieldSpace follow_fields = runtime->create_field_space(ctx);
+    allocator = runtime->create_field_allocator(ctx, follow_fields);
+    allocator.allocate_field(sizeof(channel_id_t), FOLLOWED_CHANNEL_ID);
+    Legion::LogicalRegionT<1> follows =
+        runtime->create_logical_region(ctx, follow_ids, follow_fields);
+    if (!restoring) {
+        Legion::LogicalPartition follow_block_partition =
+            runtime->get_logical_partition(
+                follows, runtime->create_partition_by_domain(
+                             ctx, follow_ids, follow_blocks, init_blocks, true,
+                             DISJOINT_KIND));
+        Legion::IndexTaskLauncher build_launcher(
+            BUILD_FOLLOWS_TASK, init_blocks,
+            Legion::TaskArgument(&graph_args, sizeof(FollowGraphArgs)),
+            Legion::ArgumentMap());
+        build_launcher.add_region_requirement(Legion::RegionRequirement(
+            user_block_partition, 0, READ_WRITE, EXCLUSIVE, users));
+        build_launcher.add_field(0, FOLLOWED_RANGE);
+        build_launcher.add_region_requirement(Legion::RegionRequirement(
+            follow_block_partition, 0, WRITE_DISCARD, EXCLUSIVE, follows));
+        build_launcher.add_field(1, FOLLOWED_CHANNEL_ID);
+        runtime->execute_index_space(ctx, build_launcher);
+    }
+    // Each user's follows, colored by user ID.
+    Legion::IndexPartition follow_id_partition =
+        runtime->create_partition_by_image_range(
+            ctx, follow_ids,
+            runtime->get_logical_partition(users, user_id_partition), users,
+            FOLLOWED_RANGE, user_ids, DISJOINT_KIND);
+
+    /* Next unread array, with an entry for each follow. Runs start by
+     * clearing it. */
+    Legion::FieldSpace next_unread_fields = runtime->create_field_space(ctx);
+    allocator = runtime->create_field_allocator(ctx, next_unread_fields);
+    allocator.allocate_field(sizeof(message_id_t), NEXT_UNREAD_MSG_ID);
+    Legion::LogicalRegionT<1> next_unreads =
+        runtime->create_logical_region(ctx, follow_ids, next_unread_fields);
+    Legion::LogicalPartition next_unread_partition =
+        runtime->get_logical_partition(next_unreads, follow_id_partition);
+
+    /* Channels array. Runs start by clearing it. */
+    Legion::Rect<1> channel_id_range(0, channel_count);
+    Legion::IndexSpaceT<1> channel_ids =
+        runtime->create_index_space(ctx, channel_id_range);
+    Legion::IndexPartition channel_id_partition =
+        runtime->create_equal_partition(ctx, channel_ids, channel_ids);
+    Legion::FieldSpace channel_fields = runtime->create_field_space(ctx);
+    allocator = runtime->create_field_allocator(ctx, channel_fields);
+    allocator.allocate_field(sizeof(message_id_t), NEXT_MSG_ID);
+    allocator.allocate_field(sizeof(message_id_t), LOW_WATER_MSG_ID);
+    Legion::LogicalRegionT<1> channels =
+        runtime->create_logical_region(ctx, channel_ids, channel_fields);
+    Legion::LogicalPartition channel_partition =
+        runtime->get_logical_partition(channels, channel_id_partition);
+
+    /* Messages array, a ring of msg_count slots for each channel. */
+    Legion::Rect<2> msg_id_range(
+        Legion::Point<2>(0, 0), Legion::Point<2>(channel_count, msg_count - 1));
+    Legion::IndexSpaceT<2> msg_ids =
+        runtime->create_index_space(ctx, msg_id_range);
+    // Each subregion holds a block of consecutive messages of one channel.
+    Legion::IndexPartition msg_id_partition =
+        runtime->create_partition_by_blockify(
+            ctx, msg_ids, Legion::Point<2>(1, msg_block_size));
+    Legion::FieldSpace msg_fields = runtime->create_field_space(ctx);
+    allocator = runtime->create_field_allocator(ctx, msg_fields);
+    allocator.allocate_field(sizeof(user_id_t), AUTHOR_ID);
+    allocator.allocate_field(sizeof(time_t), TIMESTAMP);
+    allocator.allocate_field(sizeof(TextRef), TEXT);
+    Legion::LogicalRegionT<2> messages =
+        runtime->create_logical_region(ctx, msg_ids, msg_fields);
+    Legion::LogicalPartition message_partition =
+        runtime->get_logical_partition(messages, msg_id_partition);
+    // Slots that have not been posted to yet read as empty messages.
+    if (!restoring) {
+        runtime->fill_field<user_id_t>(ctx, messages, messages, AUTHOR_ID, 0);
+        runtime->fill_field<time_t>(ctx, messages, messages, TIMESTAMP, 0);
+        runtime->fill_field<TextRef>(ctx, messages, messages, TEXT, TextRef());
+    }
+    // Batched posts need all messages of a channel, colored by channel ID.
+    Legion::Transform<2, 1> channel_to_msg;
+    channel_to_msg[0][0] = 1;
+    channel_to_msg[1][0] = 0;
+    Legion::IndexPartition channel_msg_id_partition =
+        runtime->create_partition_by_restriction(
+            ctx, msg_ids, channel_ids, channel_to_msg,
+            Legion::Rect<2>(Legion::Point<2>(0, 0),
+                            Legion::Point<2>(0, msg_count - 1)),
+            DISJOINT_KIND);
+    Legion::LogicalPartition channel_message_partition =
+        runtime->get_logical_partition(messages, channel_msg_id_partition);
+
+    /* Text arenas, one row of text_capacity bytes for each channel. */
+    uint32_t text_capacity =
+        std::max<uint64_t>((uint64_t)msg_count * TEXT_BYTES_PER_MESSAGE,
+                           TextRef::entry_size(MESSAGE_LENGTH));
+    Legion::IndexSpaceT<1> text_bytes = runtime->create_index_space(
+        ctx, Legion::Rect<1>(0, (channel_count + 1) * (uint64_t)text_capacity -
+                                    1));
+    Legion::IndexPartition text_byte_partition =
+        runtime->create_partition_by_blockify(ctx, text_bytes,
+                                              Legion::Point<1>(text_capacity));
+    Legion::FieldSpace text_fields = runtime->create_field_space(ctx);
+    allocator = runtime->create_field_allocator(ctx, text_fields);
+    allocator.allocate_field(sizeof(char), TEXT_BYTE);
+    Legion::LogicalRegionT<1> texts =
+        runtime->create_logical_region(ctx, text_bytes, text_fields);
+    Legion::LogicalPartition text_partition =
+        runtime->get_logical_partition(texts, text_byte_partition);
+
+    /* Inboxes, a ring of inbox_capacity message references for each user,
+     * and their heads. Runs start by clearing the heads. Only pushed
+     * messages need them. */
+    Legion::LogicalRegion inbox_heads, inboxes;
+    Legion::LogicalPartition inbox_head_partition, inbox_partition;
+    if (delivery == PUSH_DELIVERY) {
+        Legion::FieldSpace inbox_head_fields = runtime->create_field_space(ctx);
+        allocator = runtime->create_field_allocator(ctx, inbox_head_fields);
+        allocator.allocate_field(sizeof(uint64_t), INBOX_END);
+        allocator.allocate_field(sizeof(uint64_t), INBOX_NEXT_UNREAD);
+        inbox_heads =
+            runtime->create_logical_region(ctx, user_ids, inbox_head_fields);
+        inbox_head_partition =
+            runtime->get_logical_partition(inbox_heads, user_id_partition);
+        Legion::IndexSpaceT<2> inbox_slots = runtime->create_index_space(
+            ctx, Legion::Rect<2>(Legion::Point<2>(0, 0),
+                                 Legion::Point<2>(user_count,
+                                                  inbox_capacity - 1)));
+        Legion::Transform<2, 1> user_to_slot;
+        user_to_slot[0][0] = 1;
+        user_to_slot[1][0] = 0;
+        Legion::IndexPartition inbox_slot_partition =
+            runtime->create_partition_by_restriction(
+                ctx, inbox_slots, user_ids, user_to_slot,
+                Legion::Rect<2>(Legion::Point<2>(0, 0),
+                                Legion::Point<2>(0, inbox_capacity - 1)),
+                DISJOINT_KIND);
+        Legion::FieldSpace inbox_fields = runtime->create_field_space(ctx);
+        allocator = runtime->create_field_allocator(ctx, inbox_fields);
+        allocator.allocate_field(sizeof(InboxEntry), INBOX_ENTRY);
+        inboxes =
+            runtime->create_logical_region(ctx, inbox_slots, inbox_fields);
+        inbox_partition =
+            runtime->get_logical_partition(inboxes, inbox_slot_partition);
+    }
+
+    /* Restore the state from the files of a checkpoint, which are copied in
+     * whole and then let go of, so that they can be checkpointed over. */
+    std::vector<SavedRegion> saved_regions = {
+        {"users", users, {FOLLOWED_RANGE}},
+        {"follows", follows, {FOLLOWED_CHANNEL_ID}},
+        {"next_unreads", next_unreads, {NEXT_UNREAD_MSG_ID}},
+        {"channels", channels, {NEXT_MSG_ID, LOW_WATER_MSG_ID}},
+        {"messages", messages, {AUTHOR_ID, TIMESTAMP, TEXT}},
+        {"texts", texts, {TEXT_BYTE}}};
+    if (delivery == PUSH_DELIVERY) {
+        saved_regions.push_back(
+            {"inbox_heads", inbox_heads, {INBOX_END, INBOX_NEXT_UNREAD}});
+        saved_regions.push_back({"inboxes", inboxes, {INBOX_ENTRY}});
+    }
+    DispatchCursors cursors;
+    if (restoring) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<Legion::Future> reads;
+        for (const SavedRegion &saved : saved_regions) {
+            reads.push_back(copy_file(
+                saved, checkpoint_file(restore_path, restored.slot, saved.name),
+                false, ctx, runtime));
+        }
+        for (Legion::Future &read : reads) {
+            read.get_void_result();
+        }
+        auto stop = std::chrono::high_resolution_clock::now();
+        if (runtime->get_shard_id(ctx, true) == 0) {
+            std::cout << "Restore: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             stop - start)
+                             .count()
+                      << " ns" << std::endl;
+        }
+        // New messages go after the restored ones, in their channels and
+        // text arenas.
+        cursors.time = restored.time;
+        Legion::RegionRequirement channel_req(channels, READ_ONLY, EXCLUSIVE,
+                                              channels);
+        channel_req.add_field(NEXT_MSG_ID);
+        Legion::PhysicalRegion channel_region =
+            runtime->map_region(ctx, Legion::InlineLauncher(channel_req));
+        const Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_msg(
+            channel_region, NEXT_MSG_ID);
+        for (size_t i = 0; i < restored_text_bytes.size(); i++) {
+            cursors.next_post_ids[i] = next_msg[i];
+            cursors.next_text_bytes[i] = restored_text_bytes[i];
+        }
+        runtime->unmap_region(ctx, channel_region);
+    }
+    const FollowGraph follow_graph(users, follows, ctx, runtime);
+    // A restored graph may have been built with other partitions. Those of
+    // the dispatchers are unions of them.
+    for (user_id_t user_id = 0; user_id < user_id_range.volume(); user_id++) {
+        for (unsigned int i = 0; i < follow_graph.follow_count(user_id); i++) {
+            if (follow_graph.channel_id(user_id, i) % graph_partitions !=
+                user_id % graph_partitions) {
+                std::cerr << "User " << user_id << " follows channel "
+                          << (int)follow_graph.channel_id(user_id, i)
+                          << " of another partition" << std::endl;
+                exit(EXIT_FAILURE);
+            }
         }
+    }
 
-        case POST: {
-            PreparePostData data = {.channel_id = request.channel_id};
-            Legion::TaskLauncher launcher(
-                PREPARE_POST_TASK,
-                Legion::TaskArgument(&data, sizeof(PreparePostData)));
-            launcher.add_region_requirement(Legion::RegionRequirement(
-                runtime->get_logical_subregion_by_color(channel_partition,
-                                                        request.channel_id),
-                READ_ONLY, EXCLUSIVE, channels));
-            launcher.add_field(0, NEXT_MSG_ID);
-            pending_reqs.push_back(
-                {.future = runtime->execute_task(ctx, launcher),
-                 .request = request});
-            break;
+    /* Execute requests. */
+    // Completion queues only see tasks on this node.
+    Legion::Machine machine = Legion::Machine::get_machine();
+    Legion::Machine::ProcessorQuery local_procs(machine);
+    local_procs.local_address_space();
+    bool ordered = runtime->get_num_shards(ctx, true) > 1 ||
+                   Legion::Machine::ProcessorQuery(machine).count() !=
+                       local_procs.count();
+    // Dispatcher subtasks run on this node and report back through its memory.
+    if (n_dispatchers > 1 && ordered) {
+        std::cerr << "Several dispatchers need a single node" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    Legion::IndexSpaceT<1> dispatcher_ids = runtime->create_index_space(
+        ctx, Legion::Rect<1>(0, n_dispatchers - 1));
+    MessageRing ring = {.capacity = msg_count,
+                        .block_size = msg_block_size,
+                        .retention = (message_id_t)retention,
+                        .text_capacity = text_capacity};
+    DispatchOptions dispatch_options = {.ring = ring,
+                                        .batch_size = batch_size,
+                                        .conflict_policy = conflict_policy,
+                                        .max_retries = max_retries,
+                                        .post_mode = post_mode,
+                                        .fetch_mode = fetch_mode,
+                                        .delivery = delivery,
+                                        .fetch_budget = fetch_budget,
+                                        .tracing = tracing,
+                                        .fetch_cache = fetch_cache,
+                                        .ordered = ordered,
+                                        .n_dispatchers = n_dispatchers,
+                                        .window = window};
+    MessagingRegions messaging_regions = {
+        .users = users,
+        .follows = follows,
+        .next_unreads = next_unreads,
+        .next_unread_partition = next_unread_partition,
+        .channels = channels,
+        .channel_partition = channel_partition,
+        .messages = messages,
+        .message_partition = message_partition,
+        .channel_message_partition = channel_message_partition,
+        .texts = texts,
+        .text_partition = text_partition,
+        .inbox_heads = inbox_heads,
+        .inbox_head_partition = inbox_head_partition,
+        .inboxes = inboxes,
+        .inbox_partition = inbox_partition};
+    // Part of each saved region that each dispatcher subtask gets, by
+    // dispatcher index, in the order of saved_regions. The users and follows
+    // are only read, whole.
+    std::vector<Legion::LogicalPartition> dispatcher_parts;
+    std::vector<MessagingRegions> dispatcher_regions;
+    if (n_dispatchers > 1) {
+        auto by_dispatcher = [&](Legion::LogicalRegion region,
+                                 Legion::LogicalPartition by_id) {
+            return dispatcher_partition(region, by_id, dispatcher_ids,
+                                        n_dispatchers, ctx, runtime);
+        };
+        dispatcher_parts = {Legion::LogicalPartition::NO_PART,
+                            Legion::LogicalPartition::NO_PART,
+                            by_dispatcher(next_unreads, next_unread_partition),
+                            by_dispatcher(channels, channel_partition),
+                            by_dispatcher(messages, channel_message_partition),
+                            by_dispatcher(texts, text_partition)};
+        if (delivery == PUSH_DELIVERY) {
+            dispatcher_parts.push_back(
+                by_dispatcher(inbox_heads, inbox_head_partition));
+            dispatcher_parts.push_back(by_dispatcher(inboxes, inbox_partition));
         }
+        for (unsigned int i = 0; i < n_dispatchers; i++) {
+            auto part = [&](unsigned int saved) {
+                return runtime->get_logical_subregion_by_color(
+                    dispatcher_parts[saved], i);
+            };
+            auto restrict_to = [&](Legion::LogicalRegion region,
+                                   Legion::LogicalPartition partition) {
+                return restrict_partition(region, partition, ctx, runtime);
+            };
+            MessagingRegions parts = messaging_regions;
+            parts.next_unreads = part(2);
+            parts.next_unread_partition =
+                restrict_to(parts.next_unreads, next_unread_partition);
+            parts.channels = part(3);
+            parts.channel_partition =
+                restrict_to(parts.channels, channel_partition);
+            parts.messages = part(4);
+            parts.message_partition =
+                restrict_to(parts.messages, message_partition);
+            parts.channel_message_partition =
+                restrict_to(parts.messages, channel_message_partition);
+            parts.texts = part(5);
+            parts.text_partition = restrict_to(parts.texts, text_partition);
+            if (delivery == PUSH_DELIVERY) {
+                parts.inbox_heads = part(6);
+                parts.inbox_head_partition =
+                    restrict_to(parts.inbox_heads, inbox_head_partition);
+                parts.inboxes = part(7);
+                parts.inbox_partition =
+                    restrict_to(parts.inboxes, inbox_partition);
+            }
+            dispatcher_regions.push_back(parts);
         }
-        requests.pop_front();
-        time++;
     }
-    // Wait for all tasks to complete.
-    for (auto req : executing_reqs) {
-        switch (req.request.action) {
-        case FETCH: {
-            auto response = req.future.get_result<ExecuteFetchResponse>();
-            if (!response.success) {
-                n_failed_fetch++;
-            }
-            break;
+    std::unique_ptr<Checkpointer> checkpointer;
+    if (checkpoint_path != NULL) {
+        CheckpointHeader header = {.version = CHECKPOINT_VERSION,
+                                   // The first checkpoint goes to slot 0.
+                                   .slot = 1,
+                                   .user_count = user_count,
+                                   .channel_count = channel_count,
+                                   .msg_count = msg_count,
+                                   .follow_count = follow_count,
+                                   .inbox_capacity = inbox_capacity,
+                                   .time = 0};
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+        // Leave the restored checkpoint alone until there is a newer one.
+        if (restoring && strcmp(checkpoint_path, restore_path) == 0) {
+            header.slot = restored.slot;
         }
+        checkpointer = std::make_unique<Checkpointer>(
+            checkpoint_path, checkpoint_interval, saved_regions, header,
+            ordered, runtime->get_shard_id(ctx, true) == 0, ctx, runtime);
+    }
 
-        case POST: {
-            auto response = req.future.get_result<ExecutePostResponse>();
-            if (!response.success) {
-                n_failed_post++;
+    // Replicated dispatchers all get the same counts, so one reports them.
+    // Task statistics only cover the tasks that ran on its node.
+    bool reporting = runtime->get_shard_id(ctx, true) == 0;
+    if (reporting) {
+        std::cout << "Follows: " << follow_count << " total, " << std::fixed
+                  << std::setprecision(2)
+                  << (double)follow_count / user_id_range.volume()
+                  << " per user, in " << graph_partitions
+                  << " disjoint partitions" << std::endl;
+    }
+    std::vector<std::unique_ptr<WorkloadResults>> results;
+    for (const Workload &workload : workloads) {
+        results.push_back(std::make_unique<WorkloadResults>());
+        WorkloadResults &result = *results.back();
+        result.workload = workload;
+        for (unsigned int iteration = 0; iteration < iterations; iteration++) {
+            // Start every run from empty channels and nothing read, unless
+            // the state was restored, which runs keep adding to.
+            if (!restoring) {
+                message_id_t first_msg_id = 0;
+                Legion::FillLauncher channel_reset(
+                    channels, channels,
+                    Legion::UntypedBuffer(&first_msg_id, sizeof(message_id_t)));
+                channel_reset.add_field(NEXT_MSG_ID);
+                channel_reset.add_field(LOW_WATER_MSG_ID);
+                runtime->fill_fields(ctx, channel_reset);
+                runtime->fill_field<message_id_t>(
+                    ctx, next_unreads, next_unreads, NEXT_UNREAD_MSG_ID, 0);
+                if (delivery == PUSH_DELIVERY) {
+                    uint64_t first_entry = 0;
+                    Legion::FillLauncher inbox_reset(
+                        inbox_heads, inbox_heads,
+                        Legion::UntypedBuffer(&first_entry, sizeof(uint64_t)));
+                    inbox_reset.add_field(INBOX_END);
+                    inbox_reset.add_field(INBOX_NEXT_UNREAD);
+                    runtime->fill_fields(ctx, inbox_reset);
+                }
+                cursors = DispatchCursors();
             }
-            break;
+            // Ordered runs leave the IDs of their tasks behind.
+            std::vector<pending_id_t> stale_ids;
+            for (unsigned int i = 0; i < n_dispatchers; i++) {
+                prepared_reqs[i].drain(stale_ids);
+                executed_reqs[i].drain(stale_ids);
+            }
+
+            // Every shard generates the same requests from the same seed.
+            TraceRecorder recorder;
+            RequestGenerator generator(
+                user_count, workload.n_fetch_requests,
+                workload.n_post_requests, arrival_rate, request_skew,
+                follow_graph, rng, record_path != NULL ? &recorder : nullptr);
+            RequestRouter arrivals(n_dispatchers);
+            DispatchStats stats;
+            auto start = std::chrono::high_resolution_clock::now();
+            std::thread producer =
+                replayer ? std::thread(&TraceReplayer::run, replayer.get(),
+                                       std::ref(arrivals))
+                         : std::thread(&RequestGenerator::run, &generator,
+                                       std::ref(arrivals));
+            if (n_dispatchers == 1) {
+                Dispatcher dispatcher(dispatch_options, messaging_regions,
+                                      follow_graph, arrivals.queue(0), cursors,
+                                      checkpointer.get(), ctx, runtime);
+                dispatcher.run();
+                stats = dispatcher;
+                cursors = dispatcher.cursors();
+            } else {
+                std::vector<char> dispatcher_args =
+                    serialized(DispatcherArgs{.options = dispatch_options,
+                                              .followed = follow_graph,
+                                              .cursors = cursors});
+                Legion::ArgumentMap point_regions;
+                for (unsigned int i = 0; i < n_dispatchers; i++) {
+                    point_regions.set_point(
+                        Legion::Point<1>(i),
+                        Legion::TaskArgument(&dispatcher_regions[i],
+                                             sizeof(MessagingRegions)));
+                }
+                Legion::IndexTaskLauncher launcher(
+                    DISPATCHER_TASK, dispatcher_ids,
+                    Legion::TaskArgument(dispatcher_args.data(),
+                                         dispatcher_args.size()),
+                    point_regions);
+                for (size_t i = 0; i < saved_regions.size(); i++) {
+                    const SavedRegion &saved = saved_regions[i];
+                    unsigned int reqid = launcher.region_requirements.size();
+                    launcher.add_region_requirement(
+                        dispatcher_parts[i].exists()
+                            ? Legion::RegionRequirement(dispatcher_parts[i], 0,
+                                                        READ_WRITE, EXCLUSIVE,
+                                                        saved.region)
+                            : Legion::RegionRequirement(saved.region, 0,
+                                                        READ_ONLY, EXCLUSIVE,
+                                                        saved.region));
+                    for (Legion::FieldID field : saved.fields) {
+                        launcher.add_field(reqid, field);
+                    }
+                }
+                Legion::FutureMap dispatched =
+                    runtime->execute_index_space(ctx, launcher);
+                std::vector<DispatchCursors> dispatcher_cursors;
+                for (unsigned int i = 0; i < n_dispatchers; i++) {
+                    dispatcher_cursors.push_back(
+                        dispatched.get_result<DispatchCursors>(i));
+                    stats.merge(dispatcher_stats[i]);
+                }
+                cursors = merge_cursors(dispatcher_cursors);
+            }
+            auto stop = std::chrono::high_resolution_clock::now();
+            producer.join();
+            if (record_path != NULL && reporting) {
+                recorder.write(record_path, user_count, channel_count);
+            }
+
+            auto duration =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(stop -
+                                                                     start);
+            result.add({.seconds = duration.count() / 1e9,
+                        .n_failed_fetch = stats.n_failed_fetch,
+                        .n_failed_post = stats.n_failed_post,
+                        .n_attempts = stats.n_attempts,
+                        .n_retries = stats.n_retries,
+                        .n_cache_hits = stats.n_cache_hits},
+                       stats);
         }
+        merge_task_stats(result.task_stats);
+        reset_task_stats();
+        if (reporting) {
+            if (workloads.size() > 1) {
+                std::cout << "# requests: " << workload.n_requests
+                          << ", ratio: " << workload.request_ratio
+                          << std::endl;
+            }
+            result.print(std::cout);
         }
     }
+    // The last checkpoint holds the final state.
+    if (checkpointer) {
+        checkpointer->save(cursors);
+    }
+    if (!reporting) {
+        return;
+    }
 
-    auto stop = std::chrono::high_resolution_clock::now();
-
-    auto duration =
-        std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-    std::cout << "Time: " << duration.count() << " ns" << std::endl;
+    // Full request latency histograms, one row per nonempty bucket.
+    if (latency_path != NULL) {
+        std::ofstream csv(latency_path);
+        csv << "requests,ratio,action,phase,min_ns,max_ns,count\n";
+        for (const auto &result : results) {
+            std::string workload =
+                std::to_string(result->workload.n_requests) + "," +
+                std::to_string(result->workload.request_ratio) + ",";
+            for (unsigned int action : {FETCH, POST}) {
+                for (unsigned int i = 0; i < N_REQUEST_PHASES; i++) {
+                    result->request_latency[action][i].write_csv(
+                        csv, workload + action_names[action] + "," +
+                                 request_phase_names[i]);
+                }
+            }
+        }
+        if (!csv) {
+            std::cerr << "Cannot write " << latency_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    std::cout << std::fixed << std::setprecision(0);
-    std::cout << "Fetch: " << fetch_time / fetch_count << " ns average, "
-              << n_failed_fetch << "/" << n_fetch_requests << " failed, "
-              << fetch_message_count << " messages" << std::endl;
-    std::cout << "Post: " << post_time / post_count << " ns average, "
-              << n_failed_post << "/" << n_post_requests << " failed"
-              << std::endl;
+    // Summaries of all workloads, for scripts to read.
+    if (json_path != NULL) {
+        std::ofstream json(json_path);
+        json << "{\"iterations\": " << iterations
+             << ", \"graph_partitions\": " << graph_partitions
+             << ", \"workloads\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            json << (i == 0 ? "\n  " : ",\n  ");
+            results[i]->write_json(json);
+        }
+        json << "\n]}\n";
+        if (!json) {
+            std::cerr << "Cannot write " << json_path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
     return;
 }
@@ -542,78 +4256,315 @@ PrepareFetchResponse prepare_fetch_task(
     const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
     Legion::Runtime *runtime) {
     auto start = std::chrono::high_resolution_clock::now();
-    PrepareFetchData *data = (PrepareFetchData *)task->args;
+    PrepareFetchData data;
+    data.legion_deserialize(task_args(task));
     PrepareFetchResponse response;
-    const Legion::FieldAccessor<READ_ONLY, PerUserChannel<message_id_t>, 1>
-        next_unread(regions[0], NEXT_UNREAD_MSG_IDS);
-    memcpy(response.next_unread_msg_ids,
-           ((PerUserChannel<message_id_t>)next_unread[data->user_id]),
-           sizeof response.next_unread_msg_ids);
-    for (unsigned int i = 0; i < CHANNELS_PER_USER; i++) {
+    const Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_unread(
+        regions[0], NEXT_UNREAD_MSG_ID);
+    size_t n_channels = data.watched_channel_ids.size();
+    response.next_unread_msg_ids.resize(n_channels);
+    response.next_channel_msg_ids.resize(n_channels);
+    for (size_t i = 0; i < n_channels; i++) {
+        response.next_unread_msg_ids[i] = next_unread[data.first_follow + i];
+        // Batched launches pass the whole channels region once.
         const Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_msg(
-            regions[1 + i], NEXT_MSG_ID);
+            regions[task->is_index_space ? 1 : 1 + i], NEXT_MSG_ID);
         response.next_channel_msg_ids[i] =
-            next_msg[data->watched_channel_ids[i]];
+            next_msg[data.watched_channel_ids[i]];
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    log_messaging.debug() << "[FETCH PREPARE] took " << duration.count()
+                          << " ns, user " << data.user_id;
+    local_task_stats().latency[FETCH_PREPARE].record(duration.count());
+    prepared_reqs[dispatcher_index(data.pending_id)].push(data.pending_id);
+    return response;
+}
+
+// Regions that a fetch task gets its messages in, starting at some index.
+enum FetchLayout {
+    // The whole messages region, then the whole texts region.
+    WHOLE_REGIONS,
+    // For each channel with returned messages, its text arena and then each
+    // run of the messages in a block.
+    RETURNED_BLOCKS,
+    // For each watched channel, all its messages and then its text arena.
+    CHANNEL_ROWS,
+};
+
+/* Read the text of a message from its reference or, unless it is inlined,
+ * from the channel's text arena. Returns false if a later message took its
+ * slot, or a later text its place in the arena. */
+bool read_text(const MessageRing &ring, channel_id_t channel_id,
+               message_id_t id, const TextRef &ref,
+               const Legion::FieldAccessor<READ_ONLY, char, 1> &arena,
+               MessageText &text) {
+    if (ref.message_id != id) {
+        return false;
+    }
+    if (ref.is_inline()) {
+        memcpy(text, ref.bytes, ref.length);
+    } else {
+        const char *entry = arena.ptr(Legion::Point<1>(
+            channel_id * (uint64_t)ring.text_capacity + ref.offset()));
+        message_id_t owner;
+        memcpy(&owner, entry, sizeof owner);
+        if (owner != id) {
+            return false;
+        }
+        memcpy(text, entry + sizeof owner, ref.length);
+    }
+    text[ref.length] = '\0';
+    return true;
+}
+
+// Read a message from its slot, and its text. Returns false as read_text.
+bool read_message(const MessageRing &ring, channel_id_t channel_id,
+                  message_id_t id, const Legion::PhysicalRegion &msg_region,
+                  const Legion::PhysicalRegion &text_region, Message &msg) {
+    Legion::Point<2> msg_id(channel_id, ring.slot(id));
+    Legion::FieldAccessor<READ_ONLY, user_id_t, 2> author(msg_region,
+                                                          AUTHOR_ID);
+    Legion::FieldAccessor<READ_ONLY, time_t, 2> timestamp(msg_region,
+                                                          TIMESTAMP);
+    Legion::FieldAccessor<READ_ONLY, TextRef, 2> text(msg_region, TEXT);
+    Legion::FieldAccessor<READ_ONLY, char, 1> arena(text_region, TEXT_BYTE);
+    msg.message_id = id;
+    msg.author_id = author[msg_id];
+    msg.timestamp = timestamp[msg_id];
+    return read_text(ring, channel_id, id, text[msg_id], arena, msg.text);
+}
+
+/* Read the messages that a fetch returns, advance next_unread past them and
+ * return how many of them expired. LAYOUT is fixed at compile time, keeping
+ * the checks out of the inner loop. */
+template <FetchLayout LAYOUT>
+unsigned long long read_messages(
+    ExecuteFetchData &data, const std::vector<Legion::PhysicalRegion> &regions,
+    size_t first_region, std::vector<message_id_t> &next_unread,
+    std::vector<Message> &messages) {
+    unsigned long long n_expired = 0;
+    size_t region = LAYOUT == RETURNED_BLOCKS ? first_region - 1 : first_region;
+    size_t text_region = first_region + 1;
+    std::vector<message_id_t> firsts, lasts;
+    data.ranges(firsts, lasts);
+    for (size_t i = 0; i < firsts.size(); i++) {
+        channel_id_t channel_id = data.watched_channel_ids[i];
+        message_id_t first = firsts[i], max_msg_id = lasts[i];
+        n_expired += first - data.next_unread_msg_ids[i];
+        if (LAYOUT == CHANNEL_ROWS) {
+            region = first_region + 2 * i;
+            text_region = region + 1;
+        } else if (LAYOUT == RETURNED_BLOCKS && first != max_msg_id) {
+            text_region = ++region;
+        }
+        for (message_id_t j = first; j < max_msg_id; j++) {
+            if (LAYOUT == RETURNED_BLOCKS &&
+                (j == first || data.ring.block(j) != data.ring.block(j - 1))) {
+                region++;
+            }
+            Message msg;
+            if (!read_message(data.ring, channel_id, j, regions[region],
+                              regions[text_region], msg)) {
+                n_expired++;
+                continue;
+            }
+            messages.push_back(msg);
+        }
+        next_unread[i] = max_msg_id;
     }
+    // Each channel's messages are already in order, so this only interleaves
+    // the channels.
+    std::stable_sort(messages.begin(), messages.end(),
+                     [](const Message &a, const Message &b) {
+                         return a.timestamp < b.timestamp;
+                     });
+    return n_expired;
+}
+
+// Log and count a fetch that is about to return, and report it as executed.
+void finish_fetch(const char *label,
+                  std::chrono::high_resolution_clock::time_point start,
+                  const ExecuteFetchData &data,
+                  const ExecuteFetchResponse &response,
+                  unsigned long long n_expired) {
     auto end = std::chrono::high_resolution_clock::now();
     auto duration =
         std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-    std::cerr << "[FETCH PREPARE] took " << duration.count() << " ns, user "
-              << data->user_id << std::endl;
-    fetch_time += duration.count();
-    fetch_count++;
+    log_messaging.debug() << label << " took " << duration.count()
+                          << " ns, user " << data.user_id
+                          << (response.success ? "" : ", failed");
+    TaskStats &stats = local_task_stats();
+    stats.latency[FETCH_EXECUTE].record(duration.count());
+    stats.fetch_message_count += response.messages.size();
+    stats.fetch_expired_count += n_expired;
+    executed_reqs[dispatcher_index(data.pending_id)].push(data.pending_id);
+}
+
+// Read the user's next unread IDs for a fetch, and return whether they moved
+// since it was prepared.
+bool read_next_unread(
+    const ExecuteFetchData &data,
+    const Legion::FieldAccessor<READ_WRITE, message_id_t, 1> &next_unread,
+    std::vector<message_id_t> &user_next_unread) {
+    user_next_unread.resize(data.next_unread_msg_ids.size());
+    // Compare all channels without branching.
+    bool stale = false;
+    for (size_t i = 0; i < user_next_unread.size(); i++) {
+        user_next_unread[i] = next_unread[data.first_follow + i];
+        stale |= data.next_unread_msg_ids[i] != user_next_unread[i];
+    }
+    return stale;
+}
+
+/* Check a fetch's unread ranges against the user's next unread IDs and, if
+ * they still hold, read its messages with read(data, next_unread, messages)
+ * and advance the IDs past them. */
+template <typename Read>
+ExecuteFetchResponse execute_fetch(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, const char *label,
+    Read read) {
+    auto start = std::chrono::high_resolution_clock::now();
+    ExecuteFetchResponse response;
+    response.success = true;
+    ExecuteFetchData data;
+    data.legion_deserialize(task_args(task));
+    const Legion::FieldAccessor<READ_WRITE, message_id_t, 1> next_unread(
+        regions[0], NEXT_UNREAD_MSG_ID);
+    std::vector<message_id_t> user_next_unread;
+    response.success = !read_next_unread(data, next_unread, user_next_unread);
+    unsigned long long n_expired = 0;
+    if (response.success) {
+        n_expired = read(data, user_next_unread, response.messages);
+        for (size_t i = 0; i < user_next_unread.size(); i++) {
+            next_unread[data.first_follow + i] = user_next_unread[i];
+        }
+        response.caught_up = user_next_unread == data.next_channel_msg_ids;
+    }
+    finish_fetch(label, start, data, response, n_expired);
     return response;
 }
 
+/* Execute a fetch whose messages come in LAYOUT after the user's next unread
+ * IDs. Single launches use RETURNED_BLOCKS, as EXECUTE_FETCH_TASK, and batched
+ * ones WHOLE_REGIONS, as EXECUTE_FETCH_BATCH_TASK. */
+template <FetchLayout LAYOUT>
 ExecuteFetchResponse execute_fetch_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    return execute_fetch(
+        task, regions, "[FETCH EXECUTE]",
+        [&](ExecuteFetchData &data, std::vector<message_id_t> &next_unread,
+            std::vector<Message> &messages) {
+            return read_messages<LAYOUT>(data, regions, 1, next_unread,
+                                         messages);
+        });
+}
+
+
+/* Fetch in a single task, which can read the unread ranges itself since it
+ * holds the counters.
+ *
+ * After the user's next unread IDs, single launches of FUSED_FETCH_TASK pass
+ * the watched channels and then their messages as CHANNEL_ROWS. Batched
+ * launches of FUSED_FETCH_BATCH_TASK pass the whole channels region and then
+ * the messages as WHOLE_REGIONS. */
+template <FetchLayout LAYOUT>
+ExecuteFetchResponse fused_fetch_task(
     const Legion::Task *task,
     const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
     Legion::Runtime *runtime) {
     auto start = std::chrono::high_resolution_clock::now();
+    ExecuteFetchData data;
+    data.legion_deserialize(task_args(task));
+    const Legion::FieldAccessor<READ_WRITE, message_id_t, 1> next_unread(
+        regions[0], NEXT_UNREAD_MSG_ID);
+    size_t n_channels = data.watched_channel_ids.size();
+    data.next_unread_msg_ids.resize(n_channels);
+    data.next_channel_msg_ids.resize(n_channels);
+    for (size_t i = 0; i < n_channels; i++) {
+        data.next_unread_msg_ids[i] = next_unread[data.first_follow + i];
+        Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_msg(
+            regions[LAYOUT == WHOLE_REGIONS ? 1 : 1 + i], NEXT_MSG_ID);
+        data.next_channel_msg_ids[i] = next_msg[data.watched_channel_ids[i]];
+    }
     ExecuteFetchResponse response;
     response.success = true;
-    ExecuteFetchData *data = (ExecuteFetchData *)task->args;
-    const Legion::FieldAccessor<READ_WRITE, PerUserChannel<message_id_t>, 1>
-        next_unread(regions[0], NEXT_UNREAD_MSG_IDS);
-    PerUserChannel<message_id_t> user_next_unread = next_unread[data->user_id];
-    for (unsigned int i = 0; i < CHANNELS_PER_USER; i++) {
-        if (data->next_unread_msg_ids[i] != user_next_unread[i]) {
-            response.success = false;
-            break;
-        }
+    std::vector<message_id_t> user_next_unread = data.next_unread_msg_ids;
+    unsigned long long n_expired = read_messages<LAYOUT>(
+        data, regions, LAYOUT == WHOLE_REGIONS ? 2 : 1 + n_channels,
+        user_next_unread, response.messages);
+    for (size_t i = 0; i < n_channels; i++) {
+        next_unread[data.first_follow + i] = user_next_unread[i];
     }
-    if (response.success) {
-        unsigned long long index = 1;
-        for (unsigned int i = 0; i < CHANNELS_PER_USER; i++) {
-            message_id_t max_msg_id =
-                std::min(data->next_channel_msg_ids[i],
-                         data->next_unread_msg_ids[i] + MAX_RETURNED_MESSAGES);
-            for (message_id_t j = data->next_unread_msg_ids[i]; j < max_msg_id;
-                 j++, index++) {
-                Legion::FieldAccessor<READ_ONLY, user_id_t, 1> author(
-                    regions[index], AUTHOR_ID);
-                Legion::FieldAccessor<READ_ONLY, time_t, 1> timestamp(
-                    regions[index], TIMESTAMP);
-                Legion::FieldAccessor<READ_ONLY, MessageText, 1> text(
-                    regions[index], TEXT);
-                response.messages[index] = {.message_id = j,
-                                            .author_id = author[j],
-                                            .timestamp = timestamp[j],
-                                            .text = text[j]};
-            }
-            user_next_unread[i] = max_msg_id;
-        }
-        next_unread[data->user_id] = user_next_unread;  // Overwrite values.
-        response.num_messages = index;
+    response.caught_up = user_next_unread == data.next_channel_msg_ids;
+    finish_fetch("[FETCH FUSED]", start, data, response, n_expired);
+    return response;
+}
+
+/* Fetch the oldest unread entries of the user's inbox, up to the budget, and
+ * the messages that they refer to. Entries that the inbox has wrapped past,
+ * and those whose slot has been posted to again, count as expired, but the
+ * retention is not applied. The user's next unread IDs move past the returned
+ * messages, so low-water marks work as with pulled messages.
+ *
+ * After the next unread IDs, inbox head and inbox row of the user, single
+ * launches pass the watched channels as CHANNEL_ROWS. Batched launches pass
+ * the whole messages and texts regions. */
+ExecuteFetchResponse inbox_fetch_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    auto start = std::chrono::high_resolution_clock::now();
+    ExecuteFetchData data;
+    data.legion_deserialize(task_args(task));
+    const Legion::FieldAccessor<READ_WRITE, message_id_t, 1> next_unread(
+        regions[0], NEXT_UNREAD_MSG_ID);
+    const Legion::FieldAccessor<READ_ONLY, uint64_t, 1> inbox_end(regions[1],
+                                                                  INBOX_END);
+    const Legion::FieldAccessor<READ_WRITE, uint64_t, 1> inbox_next_unread(
+        regions[1], INBOX_NEXT_UNREAD);
+    const Legion::FieldAccessor<READ_ONLY, InboxEntry, 2> inbox(regions[2],
+                                                                INBOX_ENTRY);
+    Legion::Rect<2> inbox_range = runtime->get_index_space_domain(
+        regions[2].get_logical_region().get_index_space());
+    uint64_t capacity = inbox_range.hi[1] - inbox_range.lo[1] + 1;
+    uint64_t end = inbox_end[data.user_id];
+    uint64_t first = std::max<uint64_t>(inbox_next_unread[data.user_id],
+                              end < capacity ? 0 : end - capacity);
+    uint64_t last = std::min<uint64_t>(end, first + data.budget);
+    unsigned long long n_expired = first - inbox_next_unread[data.user_id];
+    ExecuteFetchResponse response;
+    response.success = true;
+    for (uint64_t k = first; k < last; k++) {
+        InboxEntry entry = inbox[Legion::Point<2>(data.user_id, k % capacity)];
+        size_t i = std::find(data.watched_channel_ids.begin(),
+                             data.watched_channel_ids.end(),
+                             entry.channel_id) -
+                   data.watched_channel_ids.begin();
+        size_t region = task->is_index_space ? 3 : 3 + 2 * i;
+        Message msg;
+        if (!read_message(data.ring, entry.channel_id, entry.message_id,
+                          regions[region], regions[region + 1], msg) ||
+            msg.timestamp != entry.timestamp) {
+            n_expired++;
+            continue;
+        }
+        response.messages.push_back(msg);
+        message_id_t &mark = next_unread[data.first_follow + i];
+        mark = std::max(mark, entry.message_id + 1);
     }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration =
-        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-    std::cerr << "[FETCH EXECUTE] took " << duration.count() << " ns, user "
-              << data->user_id << (response.success ? "" : ", failed")
-              << std::endl;
-    fetch_time += duration.count();
-    fetch_message_count += response.num_messages;
+    inbox_next_unread[data.user_id] = last;
+    response.caught_up = last == end;
+    // Entries arrive as their posts complete, which can be out of order.
+    std::stable_sort(response.messages.begin(), response.messages.end(),
+                     [](const Message &a, const Message &b) {
+                         return a.timestamp < b.timestamp;
+                     });
+    finish_fetch("[FETCH INBOX]", start, data, response, n_expired);
     return response;
 }
 
@@ -622,7 +4573,7 @@ PreparePostResponse prepare_post_task(
     const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
     Legion::Runtime *runtime) {
     auto start = std::chrono::high_resolution_clock::now();
-    PreparePostData *data = (PreparePostData *)task->args;
+    PreparePostData *data = task_data<PreparePostData>(task);
     PreparePostResponse response;
     Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_msg(regions[0],
                                                                NEXT_MSG_ID);
@@ -630,65 +4581,488 @@ PreparePostResponse prepare_post_task(
     auto end = std::chrono::high_resolution_clock::now();
     auto duration =
         std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-    std::cerr << "[POST PREPARE] took " << duration.count() << " ns, channel "
-              << (int)data->channel_id << std::endl;
-    post_time += duration.count();
-    post_count++;
+    log_messaging.debug() << "[POST PREPARE] took " << duration.count()
+                          << " ns, channel " << (int)data->channel_id;
+    local_task_stats().latency[POST_PREPARE].record(duration.count());
+    prepared_reqs[dispatcher_index(data->pending_id)].push(data->pending_id);
     return response;
 }
 
-ExecutePostResponse execute_post_task(
+// Reference to the text of a post, which is written to the channel's text
+// arena unless it is inlined.
+TextRef store_text(const ExecutePostData &data, message_id_t message_id,
+                   const std::vector<Legion::PhysicalRegion> &regions) {
+    TextRef ref;
+    ref.message_id = message_id;
+    ref.length = data.message.text.length();
+    if (ref.is_inline()) {
+        memcpy(ref.bytes, data.message.text.c_str(), ref.length);
+    } else {
+        ref.set_offset(data.text_offset);
+        Legion::FieldAccessor<READ_WRITE, char, 1> arena(regions[2], TEXT_BYTE);
+        char *entry = arena.ptr(Legion::Point<1>(
+            data.channel_id * (uint64_t)data.ring.text_capacity +
+            data.text_offset));
+        memcpy(entry, &message_id, sizeof message_id);
+        memcpy(entry + sizeof message_id, data.message.text.c_str(),
+               ref.length);
+    }
+    return ref;
+}
+
+// Write the message of a post to its slot, and its text.
+void store_message(const ExecutePostData &data, message_id_t message_id,
+                   const std::vector<Legion::PhysicalRegion> &regions) {
+    Legion::Point<2> msg_id(data.channel_id, data.ring.slot(message_id));
+    Legion::FieldAccessor<WRITE_DISCARD, user_id_t, 2> author(regions[1],
+                                                              AUTHOR_ID);
+    author[msg_id] = data.message.author_id;
+    Legion::FieldAccessor<WRITE_DISCARD, time_t, 2> timestamp(regions[1],
+                                                              TIMESTAMP);
+    timestamp[msg_id] = data.message.timestamp;
+    Legion::FieldAccessor<WRITE_DISCARD, TextRef, 2> text(regions[1], TEXT);
+    text[msg_id] = store_text(data, message_id, regions);
+}
+
+/* Check a post's message ID against the channel's next one and, if it is
+ * free to store, write the message with store(data, message_id, regions) and
+ * advance the channel past it. */
+template <typename Store>
+ExecutePostResponse execute_post(
     const Legion::Task *task,
-    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
-    Legion::Runtime *runtime) {
+    const std::vector<Legion::PhysicalRegion> &regions, const char *label,
+    Store store) {
     auto start = std::chrono::high_resolution_clock::now();
     ExecutePostResponse response;
     response.success = true;
-    ExecutePostData *data = (ExecutePostData *)task->args;
+    ExecutePostData post;
+    post.legion_deserialize(task_args(task));
+    ExecutePostData *data = &post;
     Legion::FieldAccessor<READ_WRITE, message_id_t, 1> next_msg(regions[0],
                                                                 NEXT_MSG_ID);
-    if (next_msg[data->channel_id] != data->next_channel_msg_id) {
+    Legion::FieldAccessor<READ_ONLY, message_id_t, 1> low_water(
+        regions[0], LOW_WATER_MSG_ID);
+    response.message_id = data->assign_id ? next_msg[data->channel_id]
+                                          : data->next_channel_msg_id;
+    response.full = !data->ring.can_store(response.message_id,
+                                          low_water[data->channel_id]);
+    if (next_msg[data->channel_id] != response.message_id || response.full) {
         response.success = false;
     }
     if (response.success) {
-        Legion::Point<2> msg_id(data->channel_id, data->next_channel_msg_id);
-        Legion::FieldAccessor<WRITE_DISCARD, user_id_t, 2> author(regions[1],
-                                                                  AUTHOR_ID);
-        author[msg_id] = data->message.author_id;
-        Legion::FieldAccessor<WRITE_DISCARD, time_t, 2> timestamp(regions[1],
-                                                                  TIMESTAMP);
-        timestamp[msg_id] = data->message.timestamp;
-        Legion::FieldAccessor<WRITE_DISCARD, MessageText, 2> text(regions[1],
-                                                                  TEXT);
-        text[msg_id] = data->message.text;
-        next_msg[data->channel_id] = next_msg[data->channel_id] + 1;
+        store(*data, response.message_id, regions);
+        next_msg[data->channel_id] = response.message_id + 1;
     }
+    response.timestamp = data->message.timestamp;
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    log_messaging.debug() << label << " took " << duration.count()
+                          << " ns, channel " << (int)data->channel_id
+                          << (response.success ? "" : ", failed");
+    local_task_stats().latency[POST_EXECUTE].record(duration.count());
+    executed_reqs[dispatcher_index(data->pending_id)].push(data->pending_id);
+    return response;
+}
+
+ExecutePostResponse execute_post_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    return execute_post(task, regions, "[POST EXECUTE]", store_message);
+}
+
+ExecutePostResponse append_post_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    auto start = std::chrono::high_resolution_clock::now();
+    ExecutePostData post;
+    post.legion_deserialize(task_args(task));
+    ExecutePostData *data = &post;
+    ExecutePostResponse response = {.success = true,
+                                    .full = false,
+                                    .message_id = data->next_channel_msg_id,
+                                    .timestamp = data->message.timestamp};
+    store_message(*data, data->next_channel_msg_id, regions);
+    const Legion::ReductionAccessor<MaxMessageId, false, 1> next_msg(
+        regions[0], NEXT_MSG_ID, MAX_MESSAGE_ID_REDOP);
+    next_msg.reduce(data->channel_id, data->next_channel_msg_id + 1);
     auto end = std::chrono::high_resolution_clock::now();
     auto duration =
         std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
-    std::cerr << "[POST EXECUTE] took " << duration.count() << ", channel "
-              << (int)data->channel_id << (response.success ? "" : ", failed")
-              << std::endl;
-    post_time += duration.count();
+    log_messaging.debug() << "[POST APPEND] took " << duration.count()
+                          << " ns, channel " << (int)data->channel_id;
+    local_task_stats().latency[POST_EXECUTE].record(duration.count());
+    executed_reqs[dispatcher_index(data->pending_id)].push(data->pending_id);
     return response;
 }
 
+// Append a delivery's entries to the inbox of its user, wrapping around over
+// the oldest ones.
+void deliver_task(const Legion::Task *task,
+                  const std::vector<Legion::PhysicalRegion> &regions,
+                  Legion::Context ctx, Legion::Runtime *runtime) {
+    auto start = std::chrono::high_resolution_clock::now();
+    DeliverData data;
+    data.legion_deserialize(task_args(task));
+    user_id_t user_id = task->index_point[0];
+    const Legion::FieldAccessor<READ_WRITE, uint64_t, 1> inbox_end(regions[0],
+                                                                   INBOX_END);
+    const Legion::FieldAccessor<READ_WRITE, InboxEntry, 2> inbox(regions[1],
+                                                                 INBOX_ENTRY);
+    Legion::Rect<2> inbox_range = runtime->get_index_space_domain(
+        regions[1].get_logical_region().get_index_space());
+    uint64_t capacity = inbox_range.hi[1] - inbox_range.lo[1] + 1;
+    uint64_t end = inbox_end[user_id];
+    for (const InboxEntry &entry : data.entries) {
+        inbox[Legion::Point<2>(user_id, end % capacity)] = entry;
+        end++;
+    }
+    inbox_end[user_id] = end;
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
+    log_messaging.debug() << "[POST DELIVER] took " << duration.count()
+                          << " ns, user " << user_id << ", "
+                          << data.entries.size() << " entries";
+    TaskStats &stats = local_task_stats();
+    stats.latency[POST_DELIVER].record(duration.count());
+    stats.delivered_count += data.entries.size();
+}
+
+/* Set each channel's low-water mark to the oldest message that one of its
+ * followers has not read, or to the next message if they have read them all.
+ * Only the channels of the launching dispatcher, those of its part of the
+ * channels region, are updated. */
+void low_water_task(const Legion::Task *task,
+                    const std::vector<Legion::PhysicalRegion> &regions,
+                    Legion::Context ctx, Legion::Runtime *runtime) {
+    const LowWaterArgs *args = (const LowWaterArgs *)task->args;
+    const Legion::FieldAccessor<READ_ONLY, channel_id_t, 1> followed(
+        regions[0], FOLLOWED_CHANNEL_ID);
+    const Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_unread(
+        regions[1], NEXT_UNREAD_MSG_ID);
+    const Legion::FieldAccessor<READ_ONLY, message_id_t, 1> next_msg(
+        regions[2], NEXT_MSG_ID);
+    const Legion::FieldAccessor<READ_WRITE, message_id_t, 1> low_water(
+        regions[3], LOW_WATER_MSG_ID);
+    // The part is sparse, with every n_dispatchers'th channel.
+    Legion::Domain channel_domain = runtime->get_index_space_domain(
+        regions[2].get_logical_region().get_index_space());
+    for (Legion::PointInDomainIterator<1> iter(channel_domain); iter();
+         iter++) {
+        low_water[*iter] = next_msg[*iter];
+    }
+    // Followers of the dispatcher's channels are its own users.
+    Legion::Rect<1> follow_range = runtime->get_index_space_domain(
+        regions[0].get_logical_region().get_index_space());
+    for (Legion::PointInRectIterator<1> iter(follow_range); iter(); iter++) {
+        channel_id_t channel_id = followed[*iter];
+        if (channel_id % args->n_dispatchers == args->index) {
+            message_id_t &mark = low_water[channel_id];
+            mark = std::min(mark, next_unread[*iter]);
+        }
+    }
+}
+
+// Random engine of an init task's block, with a stream for each task.
+std::default_random_engine block_rng(const Legion::Task *task,
+                                     unsigned int stream) {
+    std::seed_seq seeds = {(unsigned long long)task->index_point[0],
+                           (unsigned long long)stream};
+    return std::default_random_engine(seeds);
+}
+
+/* Draw how many channels each user of a block follows, set their ranges as if
+ * the block's follows started at 0 and return how many there are. With no
+ * skew, every user follows max_follows channels. Otherwise a user follows k of
+ * them with a weight of k^-skew, so most users follow few channels and some
+ * follow many. */
+follow_id_t count_follows_task(
+    const Legion::Task *task,
+    const std::vector<Legion::PhysicalRegion> &regions, Legion::Context ctx,
+    Legion::Runtime *runtime) {
+    const FollowGraphArgs *args = (const FollowGraphArgs *)task->args;
+    std::default_random_engine rng = block_rng(task, 0);
+    std::vector<double> follow_weights(args->max_follows);
+    for (unsigned int k = 1; k <= args->max_follows; k++) {
+        follow_weights[k - 1] = args->follow_skew == 0
+                                    ? k == args->max_follows
+                                    : std::pow(k, -args->follow_skew);
+    }
+    std::discrete_distribution<unsigned int> random_follow_count(
+        follow_weights.begin(), follow_weights.end());
+    const Legion::FieldAccessor<WRITE_DISCARD, Legion::Rect<1>, 1> range(
+        regions[0], FOLLOWED_RANGE);
+    Legion::Rect<1> user_range = runtime->get_index_space_domain(
+        regions[0].get_logical_region().get_index_space());
+    follow_id_t n_follows = 0;
+    for (Legion::PointInRectIterator<1> iter(user_range); iter(); iter++) {
+        follow_id_t count = random_follow_count(rng) + 1;
+        range[*iter] = Legion::Rect<1>(n_follows, n_follows + count - 1);
+        n_follows += count;
+    }
+    return n_follows;
+}
+
+/* Move the ranges of a block's follows into its block of the follows region
+ * and choose their channels. Users follow distinct channels, uniformly or,
+ * with a nonzero popularity skew, with Zipf weights by channel ID. Weighted
+ * samples take the channels with the smallest -log(u) / weight keys. */
+void build_follows_task(const Legion::Task *task,
+                        const std::vector<Legion::PhysicalRegion> &regions,
+                        Legion::Context ctx, Legion::Runtime *runtime) {
+    const FollowGraphArgs *args = (const FollowGraphArgs *)task->args;
+    std::default_random_engine rng = block_rng(task, 1);
+    const Legion::FieldAccessor<READ_WRITE, Legion::Rect<1>, 1> range(
+        regions[0], FOLLOWED_RANGE);
+    const Legion::FieldAccessor<WRITE_DISCARD, channel_id_t, 1> followed(
+        regions[1], FOLLOWED_CHANNEL_ID);
+    Legion::Rect<1> user_range = runtime->get_index_space_domain(
+        regions[0].get_logical_region().get_index_space());
+    Legion::Rect<1> follow_range = runtime->get_index_space_domain(
+        regions[1].get_logical_region().get_index_space());
+    // Channels that the users of each partition choose from.
+    std::vector<std::vector<channel_id_t>> partition_channel_ids(
+        args->n_partitions);
+    for (channel_id_t i = 0; i < args->channel_count; i++) {
+        partition_channel_ids[i % args->n_partitions].push_back(i);
+    }
+    std::vector<double> popularity =
+        zipf_weights(args->channel_count, args->popularity_skew);
+    std::vector<double> sample_keys(args->channel_count);
+    std::uniform_real_distribution<double> random_unit(0, 1);
+    for (Legion::PointInRectIterator<1> iter(user_range); iter(); iter++) {
+        Legion::Rect<1> follows = range[*iter];
+        follows = Legion::Rect<1>(follows.lo[0] + follow_range.lo[0],
+                                  follows.hi[0] + follow_range.lo[0]);
+        range[*iter] = follows;
+        size_t count = follows.volume();
+        unsigned int partition = (*iter)[0] % args->n_partitions;
+        std::vector<channel_id_t> &channel_ids =
+            partition_channel_ids[partition];
+        if (args->popularity_skew == 0) {
+            std::shuffle(channel_ids.begin(), channel_ids.end(), rng);
+        } else {
+            for (channel_id_t i = 0; i < args->channel_count; i++) {
+                if (i % args->n_partitions == partition) {
+                    sample_keys[i] =
+                        -std::log(1 - random_unit(rng)) / popularity[i];
+                }
+            }
+            std::partial_sort(channel_ids.begin(), channel_ids.begin() + count,
+                              channel_ids.end(),
+                              [&](channel_id_t a, channel_id_t b) {
+                                  return sample_keys[a] < sample_keys[b];
+                              });
+        }
+        for (size_t i = 0; i < count; i++) {
+            followed[follows.lo[0] + i] = channel_ids[i];
+        }
+    }
+}
+
+/* Sharding of launches of a replicated dispatcher by their user or channel.
+ *
+ * The default mapper replicates the dispatcher with one shard per node, in
+ * node order, so each user and channel has the same owning node here as in
+ * MessagingMapper. */
+class OwnerShardingFunctor : public Legion::ShardingFunctor {
+public:
+    Legion::ShardID shard(const Legion::DomainPoint &point,
+                          const Legion::Domain &full_space,
+                          const size_t total_shards) override {
+        return point[0] % total_shards;
+    }
+};
+
+/* Mapper that lays out messages for fetches and places tasks as asked.
+ *
+ * With OWNER_PLACEMENT, it runs each task next to the data of its user or
+ * channel. Users and channels are assigned to nodes by ID, and then to the
+ * CPUs of their node. Fetch and delivery tasks run on the owner of their user
+ * and post tasks on the owner of their channel, so each subregion keeps being
+ * used from the same memory, where its instance is kept. Launches pass the ID
+ * as their point. */
+class MessagingMapper : public Legion::Mapping::DefaultMapper {
+public:
+    MessagingMapper(Legion::Mapping::MapperRuntime *rt, Legion::Machine machine,
+                    Legion::Processor local, Placement placement)
+        : DefaultMapper(rt, machine, local, "messaging_mapper"),
+          placement(placement) {
+        Legion::Machine::ProcessorQuery query(machine);
+        query.only_kind(Legion::Processor::LOC_PROC);
+        std::map<Legion::AddressSpace, std::vector<Legion::Processor>> nodes;
+        for (Legion::Processor proc : query) {
+            nodes[proc.address_space()].push_back(proc);
+        }
+        for (auto &node : nodes) {
+            owners.push_back(std::move(node.second));
+        }
+    }
+
+    Legion::Processor default_policy_select_initial_processor(
+        Legion::Mapping::MapperContext ctx, const Legion::Task &task) override {
+        if (placed(task)) {
+            return owner(task.index_point[0]);
+        }
+        return DefaultMapper::default_policy_select_initial_processor(ctx,
+                                                                      task);
+    }
+
+    void select_sharding_functor(
+        const Legion::Mapping::MapperContext ctx, const Legion::Task &task,
+        const SelectShardingFunctorInput &input,
+        SelectShardingFunctorOutput &output) override {
+        if (!placed(task)) {
+            DefaultMapper::select_sharding_functor(ctx, task, input, output);
+            return;
+        }
+        output.chosen_functor = OWNER_SHARDING;
+        output.slice_recurse = false;
+    }
+
+    void slice_task(const Legion::Mapping::MapperContext ctx,
+                    const Legion::Task &task, const SliceTaskInput &input,
+                    SliceTaskOutput &output) override {
+        if (!placed(task)) {
+            DefaultMapper::slice_task(ctx, task, input, output);
+            return;
+        }
+        for (Legion::Domain::DomainPointIterator it(input.domain); it; it++) {
+            output.slices.push_back(TaskSlice(Legion::Domain(it.p, it.p),
+                                              owner(it.p[0]), false, false));
+        }
+    }
+
+protected:
+    /* Store each field of the messages region in its own array ordered by
+     * channel and then slot, rather than the default order by slot and then
+     * channel. A fetch then reads the author IDs, timestamps and text
+     * references of a channel's messages from adjacent elements, and only
+     * touches the text arena for the texts that it returns. The fields share
+     * an instance, as every task that uses messages asks for all three, but
+     * with the field dimension outermost each is its own dense array, so
+     * reading author IDs and timestamps does not pull in text references.
+     * The inboxes, the only other 2-D region, are likewise kept in rows by
+     * user. */
+    void default_policy_select_constraints(
+        Legion::Mapping::MapperContext ctx,
+        Legion::LayoutConstraintSet &constraints, Legion::Memory target_memory,
+        const Legion::RegionRequirement &req) override {
+        DefaultMapper::default_policy_select_constraints(ctx, constraints,
+                                                         target_memory, req);
+        if (req.region.get_dim() == 2) {
+            std::vector<Legion::DimensionKind> ordering = {
+                LEGION_DIM_Y, LEGION_DIM_X, LEGION_DIM_F};
+            constraints.ordering_constraint =
+                Legion::OrderingConstraint(ordering, false);
+        }
+    }
+
+    // Instances are only used from their owner's memory, so keep them.
+    int default_policy_select_garbage_collection_priority(
+        Legion::Mapping::MapperContext ctx, Legion::Mapping::MappingKind kind,
+        Legion::Memory memory,
+        const Legion::Mapping::PhysicalInstance &instance,
+        bool meets_fill_constraints, bool reduction) override {
+        if (placement != OWNER_PLACEMENT) {
+            return DefaultMapper::
+                default_policy_select_garbage_collection_priority(
+                    ctx, kind, memory, instance, meets_fill_constraints,
+                    reduction);
+        }
+        return LEGION_GC_NEVER_PRIORITY;
+    }
+
+private:
+    Placement placement;
+    // CPUs of each node.
+    std::vector<std::vector<Legion::Processor>> owners;
+
+    bool placed(const Legion::Task &task) const {
+        return placement == OWNER_PLACEMENT && has_owner(task);
+    }
+
+    static bool has_owner(const Legion::Task &task) {
+        switch (task.task_id) {
+        case PREPARE_FETCH_TASK:
+        case EXECUTE_FETCH_TASK:
+        case EXECUTE_FETCH_BATCH_TASK:
+        case FUSED_FETCH_TASK:
+        case FUSED_FETCH_BATCH_TASK:
+        case PREPARE_POST_TASK:
+        case EXECUTE_POST_TASK:
+        case APPEND_POST_TASK:
+        case INBOX_FETCH_TASK:
+        case DELIVER_TASK:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    Legion::Processor owner(unsigned long long id) const {
+        const std::vector<Legion::Processor> &cpus = owners[id % owners.size()];
+        return cpus[id / owners.size() % cpus.size()];
+    }
+};
+
+void register_mappers(Legion::Machine machine, Legion::Runtime *runtime,
+                      const std::set<Legion::Processor> &local_procs) {
+    const Legion::InputArgs &args = Legion::Runtime::get_input_args();
+    // Invalid values are left for the top-level task to report.
+    MapperOptions mapper_options;
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long_only(args.argc, args.argv, "", options, NULL)) !=
+           -1) {
+        parse_mapper_option(opt, optarg, mapper_options);
+    }
+    // The top-level task parses the arguments again from the start.
+    optind = 1;
+    for (Legion::Processor proc : local_procs) {
+        runtime->replace_default_mapper(
+            new MessagingMapper(runtime->get_mapper_runtime(), machine, proc,
+                                mapper_options.placement),
+            proc);
+    }
+}
+
 int main(int argc, char **argv) {
     Legion::Runtime::set_top_level_task_id(DISPATCH_TASK);
+    Legion::Runtime::register_reduction_op<MaxMessageId>(MAX_MESSAGE_ID_REDOP);
+    Legion::Runtime::add_registration_callback(register_mappers);
+    Legion::Runtime::preregister_sharding_functor(OWNER_SHARDING,
+                                                  new OwnerShardingFunctor());
 
     {
         Legion::TaskVariantRegistrar registrar(DISPATCH_TASK, "dispatch");
         registrar.add_constraint(
             Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        // Let the mapper run one dispatcher shard on each node.
+        registrar.set_replicable();
         Legion::Runtime::preregister_task_variant<dispatch_task>(registrar,
                                                                  "dispatch");
     }
 
+    {
+        Legion::TaskVariantRegistrar registrar(DISPATCHER_TASK, "dispatcher");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_inner();
+        Legion::Runtime::preregister_task_variant<DispatchCursors,
+                                                  dispatcher_task>(
+            registrar, "dispatcher");
+    }
+
     {
         Legion::TaskVariantRegistrar registrar(PREPARE_FETCH_TASK,
                                                "prepare_fetch");
         registrar.add_constraint(
             Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
         Legion::Runtime::preregister_task_variant<PrepareFetchResponse,
                                                   prepare_fetch_task>(
             registrar, "prepare_fetch");
@@ -699,16 +5073,29 @@ int main(int argc, char **argv) {
                                                "execute_fetch");
         registrar.add_constraint(
             Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
-        Legion::Runtime::preregister_task_variant<ExecuteFetchResponse,
-                                                  execute_fetch_task>(
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<
+            ExecuteFetchResponse, execute_fetch_task<RETURNED_BLOCKS>>(
             registrar, "execute_fetch");
     }
 
+    {
+        Legion::TaskVariantRegistrar registrar(EXECUTE_FETCH_BATCH_TASK,
+                                               "execute_fetch_batch");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<
+            ExecuteFetchResponse, execute_fetch_task<WHOLE_REGIONS>>(
+            registrar, "execute_fetch_batch");
+    }
+
     {
         Legion::TaskVariantRegistrar registrar(PREPARE_POST_TASK,
                                                "prepare_post");
         registrar.add_constraint(
             Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
         Legion::Runtime::preregister_task_variant<PreparePostResponse,
                                                   prepare_post_task>(
             registrar, "prepare_post");
@@ -719,10 +5106,91 @@ int main(int argc, char **argv) {
                                                "execute_post");
         registrar.add_constraint(
             Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
         Legion::Runtime::preregister_task_variant<ExecutePostResponse,
                                                   execute_post_task>(
             registrar, "execute_post");
     }
 
+    {
+        Legion::TaskVariantRegistrar registrar(APPEND_POST_TASK, "append_post");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<ExecutePostResponse,
+                                                  append_post_task>(
+            registrar, "append_post");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(FUSED_FETCH_TASK, "fused_fetch");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<
+            ExecuteFetchResponse, fused_fetch_task<CHANNEL_ROWS>>(
+            registrar, "fused_fetch");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(FUSED_FETCH_BATCH_TASK,
+                                               "fused_fetch_batch");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<
+            ExecuteFetchResponse, fused_fetch_task<WHOLE_REGIONS>>(
+            registrar, "fused_fetch_batch");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(LOW_WATER_TASK, "low_water");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<low_water_task>(registrar,
+                                                                  "low_water");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(COUNT_FOLLOWS_TASK,
+                                               "count_follows");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<follow_id_t,
+                                                  count_follows_task>(
+            registrar, "count_follows");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(BUILD_FOLLOWS_TASK,
+                                               "build_follows");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<build_follows_task>(
+            registrar, "build_follows");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(INBOX_FETCH_TASK, "inbox_fetch");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<ExecuteFetchResponse,
+                                                  inbox_fetch_task>(
+            registrar, "inbox_fetch");
+    }
+
+    {
+        Legion::TaskVariantRegistrar registrar(DELIVER_TASK, "deliver");
+        registrar.add_constraint(
+            Legion::ProcessorConstraint(Legion::Processor::LOC_PROC));
+        registrar.set_leaf(LEAF_TASKS);
+        Legion::Runtime::preregister_task_variant<deliver_task>(registrar,
+                                                                "deliver");
+    }
+
     return Legion::Runtime::start(argc, argv);
 }
@@ -1,60 +1,182 @@
 #!/usr/bin/env python3
+import itertools
+import json
+import math
 import os.path
 import subprocess
+import sys
+import tempfile
 
 ITERATIONS = 30
 
 USERS = [1, 2, 5, 10, 20, 50, 100]
 CHANNELS = [5, 10, 20, 50, 100]
 MESSAGES = [500]
+BLOCK_SIZES = [1]
+BATCH_SIZES = [1]
+CONFLICT_POLICIES = ["drop"]
+POST_MODES = ["checked"]
+FETCH_MODES = ["split"]
+# Pushed posts go to the inboxes of followers, which fetches then read.
+DELIVERIES = ["pull"]
+FETCH_BUDGETS = [20]
+# Channels per user, or the most of them with a nonzero skew.
+MAX_FOLLOWS = [4]
+FOLLOW_SKEWS = [0]
+# Zipf exponents of channel popularity in follows, of posting users and of the
+# followed channels posted to, where 0 is uniform.
+POPULARITY_SKEWS = [0]
+POSTER_SKEWS = [0]
+CHANNEL_SKEWS = [0]
+# Tracing needs batches of fused fetches and assigned or appended posts.
+TRACING = [False]
+# Answering fetches with nothing new from the dispatcher, without a task.
+FETCH_CACHES = [False]
+PLACEMENTS = ["default"]
+# Dispatcher subtasks that split the requests by user and channel.
+DISPATCHERS = [1]
+# Every dispatcher count runs on the same graph, partitioned for all of them.
+GRAPH_PARTITIONS = math.lcm(*DISPATCHERS)
+# Launches that each dispatcher keeps outstanding, trading latency for
+# throughput.
+WINDOWS = [64]
+# Arrivals per second, or 0 for all requests at once.
+ARRIVAL_RATES = [0]
 
 REQUESTS = [1, 2, 5, 10, 20, 50, 100, 200, 500, 1000]
 RATIOS = [1, 10]
 CPUS = [2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]
 
 
-for n in USERS:
-    for k in CHANNELS:
-        for m in MESSAGES:
-            print("# users:", n)
-            print("# channels:", k)
-            print("# messages:", m)
+for n, k, m, b, g, c, p, u, x, q, d, s, v, z, h, j, e, a, i, w, l in itertools.product(
+    USERS,
+    CHANNELS,
+    MESSAGES,
+    BLOCK_SIZES,
+    BATCH_SIZES,
+    CONFLICT_POLICIES,
+    POST_MODES,
+    FETCH_MODES,
+    DELIVERIES,
+    FETCH_BUDGETS,
+    MAX_FOLLOWS,
+    FOLLOW_SKEWS,
+    POPULARITY_SKEWS,
+    POSTER_SKEWS,
+    CHANNEL_SKEWS,
+    TRACING,
+    FETCH_CACHES,
+    PLACEMENTS,
+    DISPATCHERS,
+    WINDOWS,
+    ARRIVAL_RATES,
+):
+    print("# users:", n)
+    print("# channels:", k)
+    print("# messages:", m)
+    print("# block size:", b)
+    print("# batch size:", g)
+    print("# conflict policy:", c)
+    print("# post mode:", p)
+    print("# fetch mode:", u)
+    print("# delivery:", x)
+    print("# fetch budget:", q)
+    print("# max follows:", d)
+    print("# follow skew:", s)
+    print("# popularity skew:", v)
+    print("# poster skew:", z)
+    print("# channel skew:", h)
+    print("# tracing:", j)
+    print("# fetch cache:", e)
+    print("# placement:", a)
+    print("# dispatchers:", i)
+    print("# graph partitions:", GRAPH_PARTITIONS)
+    print("# window:", w)
+    print("# arrival rate:", l)
+    print()
+    print("requests ratio  " + " ".join(f"{c:4d}" for c in CPUS))
+    # One process runs every workload, warm, for each CPU count.
+    times = {}
+    for cpu in CPUS:
+        with tempfile.NamedTemporaryFile(suffix=".json") as results:
+            prog = subprocess.run(
+                [
+                    os.path.join(os.getcwd(), "messaging"),
+                    "-n",
+                    str(n),
+                    "-k",
+                    str(k),
+                    "-m",
+                    str(m),
+                    "-t",
+                    ",".join(map(str, REQUESTS)),
+                    "-r",
+                    ",".join(map(str, RATIOS)),
+                    "-i",
+                    str(ITERATIONS),
+                    "-b",
+                    str(b),
+                    "-g",
+                    str(g),
+                    "-c",
+                    c,
+                    "-p",
+                    p,
+                    "-u",
+                    u,
+                    "-D",
+                    x,
+                    "-q",
+                    str(q),
+                    "-d",
+                    str(d),
+                    "-s",
+                    str(s),
+                    "-v",
+                    str(v),
+                    "-z",
+                    str(z),
+                    "-h",
+                    str(h),
+                    "-a",
+                    a,
+                    "-K",
+                    str(i),
+                    "-Q",
+                    str(GRAPH_PARTITIONS),
+                    "-W",
+                    str(w),
+                    "-l",
+                    str(l),
+                    "-y",
+                    results.name,
+                    "-ll:cpu",
+                    str(cpu),
+                    "-level",
+                    "5",
+                ]
+                + (["-j"] if j else [])
+                + (["-H"] if e else []),
+                bufsize=0,
+                capture_output=True,
+                text=True,
+            )
+            if prog.returncode != 0:
+                print(
+                    f"# {cpu} CPUs failed with status {prog.returncode}:",
+                    prog.stderr.strip(),
+                    file=sys.stderr,
+                )
+                continue
+            for workload in json.load(results)["workloads"]:
+                key = (workload["requests"], workload["ratio"])
+                times[key, cpu] = workload["time_ns"]["mean"]
+    for t in REQUESTS:
+        for r in RATIOS:
+            print(f"{t:{len('requests')}d} {r:{len('ratio')}d}  ", end="")
+            for cpu in CPUS:
+                if ((t, r), cpu) not in times:
+                    print(f"{'-':>4} ", end="")
+                    continue
+                print(f"{times[(t, r), cpu] / 1e6 : 4.0f} ", end="")
             print()
-            print("requests ratio  " + " ".join(f"{c:4d}" for c in CPUS))
-            for t in REQUESTS:
-                for r in RATIOS:
-                    print(f"{t:{len('requests')}d} {r:{len('ratio')}d}  ", end="")
-                    for cpu in CPUS:
-                        times = []
-                        for _ in range(ITERATIONS):
-                            prog = subprocess.run(
-                                [
-                                    os.path.join(os.getcwd(), "messaging"),
-                                    "-n",
-                                    str(n),
-                                    "-k",
-                                    str(k),
-                                    "-m",
-                                    str(m),
-                                    "-t",
-                                    str(t),
-                                    "-r",
-                                    str(r),
-                                    "-ll:cpu",
-                                    str(cpu),
-                                    "-level",
-                                    "5",
-                                ],
-                                bufsize=0,
-                                capture_output=True,
-                                text=True,
-                            )
-                            if prog.returncode != 0:
-                                continue
-                            time = prog.stdout.splitlines()[0].split()[1]
-                            times.append(int(time))
-                        if not times:
-                            print(" " * 5, end="")
-                            continue
-                        print(f"{sum(times) / len(times) / 1e6 : 4.0f} ", end="")
-                    print()